@@ -12,6 +12,8 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Device ROOTDEV is the program disk, RAIDDEV the RAID array.
 
 
 #include "types.h"
@@ -22,6 +24,12 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "raid.h"
+
+// Blocks read ahead of a miss that follows on from the last one.
+#define NREADAHEAD 8
+// Unreferenced buffers read-ahead leaves for everyone else.
+#define NRESERVE (NBUF/4)
 
 struct {
   struct spinlock lock;
@@ -31,6 +39,11 @@ struct {
   // Sorted by how recently the buffer was used.
   // head.next is most recent, head.prev is least.
   struct buf head;
+
+  // The block just past the last read from each device, so
+  // that a miss there is known to be part of a sequential scan.
+  // Only a hint, so kept without the lock.
+  uint next[NDISKDEV+1];
 } bcache;
 
 void
@@ -88,27 +101,183 @@ bget(uint dev, uint blockno)
   panic("bget: no buffers");
 }
 
+// Take locked buffers for up to n blocks of dev from blockno on,
+// stopping at the first that is cached, for reading ahead,
+// and keeping NRESERVE unreferenced buffers back for bget().
+// Returns how many it took.
+static int
+bgetahead(uint dev, uint blockno, int n, struct buf **bs)
+{
+  struct buf *b;
+  int k, nfree = 0;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->refcnt == 0)
+      nfree++;
+  }
+  if(n > nfree - NRESERVE)
+    n = nfree - NRESERVE;
+  for(k = 0; k < n; k++){
+    for(b = bcache.head.next; b != &bcache.head; b = b->next){
+      if(b->dev == dev && b->blockno == blockno + k)
+        goto out;
+    }
+    for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
+      if(b->refcnt == 0)
+        break;
+    }
+    if(b == &bcache.head)
+      break;
+    b->dev = dev;
+    b->blockno = blockno + k;
+    b->valid = 0;
+    b->refcnt = 1;
+    // No one holds an unreferenced buffer, so this can't sleep,
+    // and no one can get at the block before it is read.
+    acquiresleep(&b->lock);
+    bs[k] = b;
+  }
+out:
+  release(&bcache.lock);
+  return k;
+}
+
+// What brw() needs to move several blocks in one go, in a
+// kalloc()ed page rather than on the kernel stack.
+struct brw_batch {
+  uchar *data[NREADAHEAD+1];
+  struct disk_req r[NREADAHEAD+1];
+};
+
+// Read or write bs[0 .. n), consecutive blocks of one device,
+// with as few device requests as will do. Returns -1 if the
+// RAID array lost one of them.
+static int
+brw(struct buf **bs, int n, int write)
+{
+  struct brw_batch *bt;
+  int ret = 0;
+
+  if(n == 1 && bs[0]->dev != RAIDDEV){
+    virtio_disk_rw(VIRTIO0_ID, bs[0], write);
+    return 0;
+  }
+  if(n == 1){
+    uchar *data = bs[0]->data;
+    return write ? raid_write_blocks(bs[0]->blockno, 1, &data) :
+                   raid_read_blocks(bs[0]->blockno, 1, &data);
+  }
+  if((bt = kalloc()) == 0){
+    // a block at a time, then.
+    for(int i = 0; i < n; i++){
+      if(brw(&bs[i], 1, write) < 0)
+        ret = -1;
+    }
+    return ret;
+  }
+
+  for(int i = 0; i < n; i++)
+    bt->data[i] = bs[i]->data;
+  if(bs[0]->dev != RAIDDEV){
+    for(int i = 0; i < n; i++){
+      bt->r[i].diskn = VIRTIO0_ID;
+      bt->r[i].blockno = bs[i]->blockno;
+      bt->r[i].data = bt->data[i];
+      bt->r[i].write = write;
+      bs[i]->disk = 1;
+    }
+    virtio_disk_submit(bt->r, n);
+    virtio_disk_wait(bt->r, n);
+    for(int i = 0; i < n; i++)
+      bs[i]->disk = 0;
+  } else if(write){
+    ret = raid_write_blocks(bs[0]->blockno, n, bt->data);
+  } else {
+    ret = raid_read_blocks(bs[0]->blockno, n, bt->data);
+  }
+  kfree(bt);
+  return ret;
+}
+
 // Return a locked buf with the contents of the indicated block.
+// A miss just past the last block read from dev reads the blocks
+// after it too, if they aren't cached, in the same device request,
+// and leaves them in the cache. If the block can't be read, the
+// buf comes back zeroed, with valid 0.
 struct buf*
 bread(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *bs[NREADAHEAD+1];
+  int n = 1;
 
-  b = bget(dev, blockno);
-  if(!b->valid) {
-    virtio_disk_rw(VIRTIO0_ID, b, 0);
-    b->valid = 1;
+  bs[0] = bget(dev, blockno);
+  if(!bs[0]->valid) {
+    if(blockno == bcache.next[dev]){
+      uint size = bdevsize(dev);
+      int ahead = NREADAHEAD;
+      if(blockno + 1 + ahead > size)
+        ahead = blockno + 1 < size ? size - blockno - 1 : 0;
+      n += bgetahead(dev, blockno + 1, ahead, bs + 1);
+    }
+    bcache.next[dev] = blockno + n;
+    if(brw(bs, n, 0) == 0){
+      for(int i = 0; i < n; i++)
+        bs[i]->valid = 1;
+    } else {
+      memset(bs[0]->data, 0, BSIZE);
+    }
+    for(int i = 1; i < n; i++)
+      brelse(bs[i]);
   }
-  return b;
+  return bs[0];
 }
 
 // Write b's contents to disk.  Must be locked.
-void
+// Returns -1 if the RAID array lost the block.
+int
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(VIRTIO0_ID, b, 1);
+  return brw(&b, 1, 1);
+}
+
+// Forget the cached blocks of dev, which was written to behind the
+// cache's back while it was not mounted.
+void
+binval(uint dev)
+{
+  struct buf *b;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dev == dev && b->refcnt == 0)
+      b->valid = 0;
+  }
+  release(&bcache.lock);
+}
+
+// Wait until the writes to dev so far are on disk. The program disk
+// writes through; the RAID array can hold writes in its stripe cache.
+void
+bsync(uint dev)
+{
+  if(dev == RAIDDEV && raid_sync() < 0)
+    panic("bsync");
+}
+
+// Number of blocks of dev, 0 if it is not there.
+uint
+bdevsize(uint dev)
+{
+  uint blocks, bsize, ndisks;
+
+  if(dev == ROOTDEV)
+    return virtio_disk_blocks(VIRTIO0_ID);
+  if(dev == RAIDDEV && sys_info_raid_impl(&blocks, &bsize, &ndisks) == 0)
+    return blocks;
+  return 0;
 }
 
 // Release a locked buffer.
@@ -10,3 +10,13 @@ struct buf {
   uchar data[BSIZE];
 };
 
+
+// a block transfer that can be left in flight,
+// see virtio_disk_submit() and virtio_disk_wait().
+struct disk_req {
+  int diskn;     // virtio disk id
+  uint blockno;
+  uchar *data;   // BSIZE bytes
+  int write;
+  int done;      // has the device finished with it?
+};
@@ -3,6 +3,7 @@ typedef uint64 *pagetable_t;
 typedef uint64 pte_t;
 struct buf;
 struct context;
+struct disk_req;
 struct file;
 struct inode;
 struct pipe;
@@ -16,9 +17,12 @@ struct superblock;
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
-void            bwrite(struct buf*);
+int             bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            binval(uint);
+void            bsync(uint);
+uint            bdevsize(uint);
 
 // console.c
 void            consoleinit(void);
@@ -39,6 +43,8 @@ int             filewrite(struct file*, uint64, int n);
 
 // fs.c
 void            fsinit(int);
+int             fsmount(uint, struct inode*);
+int             fsmounted(uint);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
@@ -73,12 +79,25 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// parity.c
+void            xor_blocks(uchar *, uchar **, int);
+void            gen_pq(uchar *, uchar *, uchar **, int);
+void            gf_mul_acc(uchar *, uchar *, uchar);
+void            gf_init(void);
+uchar           gf_pow2(int);
+uchar           gf_inv(uchar);
+void            raid6_recover(uchar **, int, int, int);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
 
+// raid.c
+void            raidinit(void);
+void            raid_assemble(void);
+
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
@@ -104,6 +123,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread_create(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -153,6 +173,7 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+uint64          mtime(void);
 
 // uart.c
 void            uartinit(void);
@@ -188,8 +209,16 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(int id, char* name);
+int             virtio_disk_probe(int id);
+uint64          virtio_disk_blocks(int id);
+int             virtio_raid_disks(void);
 void            virtio_disk_rw(int id, struct buf *, int);
 void            virtio_disk_intr(int id);
+void            virtio_disk_submit(struct disk_req *, int);
+void            virtio_disk_wait(struct disk_req *, int);
+int             virtio_disk_poll(int id, int mode);
+int             virtio_disk_sched(int id, int sched);
+void            rw_blocks(struct disk_req *, int);
 void            write_block(int diskn, int blockno, uchar* data);
 void            read_block(int diskn, int blockno, uchar* data);
 
@@ -198,5 +227,14 @@ void            read_block(int diskn, int blockno, uchar* data);
 
 #define VIRTIO0_ID 0
 #define VIRTIO_RAID_DISK_START (1)
-#define VIRTIO_RAID_DISK_END (DISKS)
-#define VIRTIO_RAID_DISK_SIZE (4096)
\ No newline at end of file
+#define VIRTIO_RAID_DISK_END (NRAIDDISK)
+
+// how waiters on a virtio disk learn of completions; see virtio_disk_poll().
+#define VIRTIO_POLL_OFF 0      // sleep for the interrupt
+#define VIRTIO_POLL_ON 1       // spin on the used ring a while first
+#define VIRTIO_POLL_ADAPTIVE 2 // spin only when the queue is deep
+
+// the order queued requests go to a virtio disk in; see virtio_disk_sched().
+#define VIRTIO_SCHED_NOOP 0     // as they came
+#define VIRTIO_SCHED_DEADLINE 1 // reads first, by block, with expiry times
+#define VIRTIO_SCHED_CLOOK 2    // by block, sweeping up the disk
\ No newline at end of file
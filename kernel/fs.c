@@ -22,9 +22,17 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
-// there should be one superblock per disk device, but we run with
-// only one device
-struct superblock sb; 
+// one superblock per disk device, indexed by device number: ROOTDEV,
+// and RAIDDEV once it is mounted.
+struct superblock sb[NDISKDEV+1];
+
+// on[dev] is the directory of the root file system that device dev
+// is mounted on, or 0. A device stays mounted until reboot.
+static struct {
+  struct spinlock lock;
+  struct inode *on[NDISKDEV+1];
+  int busy[NDISKDEV+1];  // fsmount() is at work on it
+} mounted;
 
 // Read the super block.
 static void
@@ -40,10 +48,67 @@ readsb(int dev, struct superblock *sb)
 // Init fs
 void
 fsinit(int dev) {
-  readsb(dev, &sb);
-  if(sb.magic != FSMAGIC)
+  initlock(&mounted.lock, "mounted");
+  readsb(dev, &sb[dev]);
+  if(sb[dev].magic != FSMAGIC)
     panic("invalid file system");
-  initlog(dev, &sb);
+  initlog(dev, &sb[dev]);
+}
+
+// Mount the file system on device dev on directory ip of the root
+// file system, recovering its log. On success the mount keeps the
+// caller's reference to ip.
+int
+fsmount(uint dev, struct inode *ip)
+{
+  if(dev == ROOTDEV || dev > NDISKDEV)
+    return -1;
+  acquire(&mounted.lock);
+  if(mounted.on[dev] || mounted.busy[dev]){
+    release(&mounted.lock);
+    return -1;
+  }
+  mounted.busy[dev] = 1;
+  release(&mounted.lock);
+
+  // raw writes may have changed dev since the cache last saw it.
+  binval(dev);
+  ilock(ip);
+  if(ip->type != T_DIR || ip->dev != ROOTDEV || ip->inum == ROOTINO)
+    goto bad;
+  if(bdevsize(dev) <= 1)
+    goto bad;
+  readsb(dev, &sb[dev]);
+  if(sb[dev].magic != FSMAGIC || sb[dev].size > bdevsize(dev) ||
+     sb[dev].nlog < 2 || sb[dev].logstart + sb[dev].nlog > sb[dev].size)
+    goto bad;
+  iunlock(ip);
+  initlog(dev, &sb[dev]);
+
+  acquire(&mounted.lock);
+  mounted.on[dev] = ip;
+  mounted.busy[dev] = 0;
+  release(&mounted.lock);
+  return 0;
+
+bad:
+  iunlock(ip);
+  acquire(&mounted.lock);
+  mounted.busy[dev] = 0;
+  release(&mounted.lock);
+  return -1;
+}
+
+// Is the file system on dev mounted, or being mounted?
+int
+fsmounted(uint dev)
+{
+  int r;
+
+  acquire(&mounted.lock);
+  r = mounted.on[dev] != 0 || mounted.busy[dev];
+  release(&mounted.lock);
+  return r;
 }
 
 // Zero a block.
@@ -69,9 +134,9 @@ balloc(uint dev)
   struct buf *bp;
 
   bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+  for(b = 0; b < sb[dev].size; b += BPB){
+    bp = bread(dev, BBLOCK(b, sb[dev]));
+    for(bi = 0; bi < BPB && b + bi < sb[dev].size; bi++){
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
         bp->data[bi/8] |= m;  // Mark block in use.
@@ -94,7 +159,7 @@ bfree(int dev, uint b)
   struct buf *bp;
   int bi, m;
 
-  bp = bread(dev, BBLOCK(b, sb));
+  bp = bread(dev, BBLOCK(b, sb[dev]));
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
@@ -112,7 +177,7 @@ bfree(int dev, uint b)
 // list of blocks holding the file's content.
 //
 // The inodes are laid out sequentially on disk at block
-// sb.inodestart. Each inode has a number, indicating its
+// sb[dev].inodestart. Each inode has a number, indicating its
 // position on the disk.
 //
 // The kernel keeps a table of in-use inodes in memory
@@ -202,8 +267,8 @@ ialloc(uint dev, short type)
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
+  for(inum = 1; inum < sb[dev].ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, sb[dev]));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
@@ -228,7 +293,7 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  bp = bread(ip->dev, IBLOCK(ip->inum, sb[ip->dev]));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
@@ -301,7 +366,7 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread(ip->dev, IBLOCK(ip->inum, sb[ip->dev]));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
@@ -484,6 +549,11 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
+    if(!bp->valid) {
+      brelse(bp);
+      tot = -1;
+      break;
+    }
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -518,6 +588,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
+    if(!bp->valid) {
+      brelse(bp);
+      break;
+    }
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
@@ -644,6 +718,25 @@ skipelem(char *path, char *name)
   return path;
 }
 
+// If a file system is mounted on ip, drop ip and return the root of
+// that file system instead.
+static struct inode*
+crossmount(struct inode *ip)
+{
+  int dev;
+
+  acquire(&mounted.lock);
+  for(dev = 1; dev <= NDISKDEV; dev++){
+    if(mounted.on[dev] == ip)
+      break;
+  }
+  release(&mounted.lock);
+  if(dev > NDISKDEV)
+    return ip;
+  iput(ip);
+  return iget(dev, ROOTINO);
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
@@ -669,12 +762,19 @@ namex(char *path, int nameiparent, char *name)
       iunlock(ip);
       return ip;
     }
+    if(ip->dev != ROOTDEV && ip->inum == ROOTINO && namecmp(name, "..") == 0){
+      // up out of a mounted file system, from the directory it is on.
+      next = idup(mounted.on[ip->dev]);
+      iunlockput(ip);
+      ip = next;
+      ilock(ip);
+    }
     if((next = dirlookup(ip, name, 0)) == 0){
       iunlockput(ip);
       return 0;
     }
     iunlockput(ip);
-    ip = next;
+    ip = crossmount(next);
   }
   if(nameiparent){
     iput(ip);
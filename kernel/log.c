@@ -29,6 +29,11 @@
 //   block C
 //   ...
 // Log appends are synchronous.
+//
+// Every mounted device has a log of its own, and a commit commits
+// each of them; an FS system call only writes to one device. A device
+// that caches writes, like the RAID array, is synced between the steps
+// of a commit, so that they reach the disks in order.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -37,42 +42,54 @@ struct logheader {
   int block[LOGSIZE];
 };
 
+// The log of one device.
+struct devlog {
+  int start;
+  int size;        // 0 if the device has no log (yet).
+  int dev;
+  struct logheader lh;
+};
+
 struct log {
   struct spinlock lock;
-  int start;
-  int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
-  int dev;
-  struct logheader lh;
+  struct devlog dl[NDISKDEV+1]; // indexed by device number
 };
 struct log log;
 
-static void recover_from_log(void);
+static void recover_from_log(struct devlog *dl);
 static void commit();
 
 void
 initlog(int dev, struct superblock *sb)
 {
+  struct devlog *dl = &log.dl[dev];
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
-  initlock(&log.lock, "log");
-  log.start = sb->logstart;
-  log.size = sb->nlog;
-  log.dev = dev;
-  recover_from_log();
+  if(dev == ROOTDEV)
+    initlock(&log.lock, "log");
+  dl->start = sb->logstart;
+  dl->dev = dev;
+  // no FS call can reach dev until it is mounted, so it is
+  // recovered outside of any transaction.
+  recover_from_log(dl);
+  acquire(&log.lock);
+  dl->size = sb->nlog;
+  release(&log.lock);
 }
 
 // Copy committed blocks from log to their home location
 static void
-install_trans(int recovering)
+install_trans(struct devlog *dl, int recovering)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+  for (tail = 0; tail < dl->lh.n; tail++) {
+    struct buf *lbuf = bread(dl->dev, dl->start+tail+1); // read log block
+    struct buf *dbuf = bread(dl->dev, dl->lh.block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
     if(recovering == 0)
@@ -84,14 +101,14 @@ install_trans(int recovering)
 
 // Read the log header from disk into the in-memory log header
 static void
-read_head(void)
+read_head(struct devlog *dl)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(dl->dev, dl->start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  dl->lh.n = lh->n;
+  for (i = 0; i < dl->lh.n; i++) {
+    dl->lh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
@@ -100,26 +117,40 @@ read_head(void)
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(void)
+write_head(struct devlog *dl)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(dl->dev, dl->start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = dl->lh.n;
+  for (i = 0; i < dl->lh.n; i++) {
+    hb->block[i] = dl->lh.block[i];
   }
   bwrite(buf);
   brelse(buf);
 }
 
 static void
-recover_from_log(void)
+recover_from_log(struct devlog *dl)
+{
+  read_head(dl);
+  install_trans(dl, 1); // if committed, copy from log to disk
+  bsync(dl->dev);
+  dl->lh.n = 0;
+  write_head(dl); // clear the log
+  bsync(dl->dev);
+}
+
+// Might one more FS sys call exhaust the space of some log?
+static int
+log_full(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  for(int dev = 1; dev <= NDISKDEV; dev++){
+    if(log.dl[dev].size > 0 &&
+       log.dl[dev].lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE)
+      return 1;
+  }
+  return 0;
 }
 
 // called at the start of each FS system call.
@@ -130,7 +161,7 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log_full()){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -175,30 +206,59 @@ end_op(void)
 }
 
 // Copy modified blocks from cache to log.
-static void
-write_log(void)
+// Returns -1 if the device lost one of them.
+static int
+write_log(struct devlog *dl)
 {
-  int tail;
+  int tail, ret = 0;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  for (tail = 0; tail < dl->lh.n; tail++) {
+    struct buf *to = bread(dl->dev, dl->start+tail+1); // log block
+    struct buf *from = bread(dl->dev, dl->lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    if(bwrite(to) < 0)  // write the log
+      ret = -1;
     brelse(from);
     brelse(to);
   }
+  return ret;
+}
+
+// Drop a transaction that couldn't be logged. Its blocks stay
+// as it left them in the cache, but are no longer pinned there.
+static void
+abandon_trans(struct devlog *dl)
+{
+  int tail;
+
+  for (tail = 0; tail < dl->lh.n; tail++) {
+    struct buf *b = bread(dl->dev, dl->lh.block[tail]);
+    bunpin(b);
+    brelse(b);
+  }
+  dl->lh.n = 0;
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  for(int dev = 1; dev <= NDISKDEV; dev++){
+    struct devlog *dl = &log.dl[dev];
+    if (dl->size > 0 && dl->lh.n > 0) {
+      if (write_log(dl) < 0) {  // Write modified blocks from cache to log
+        printf("commit: dev %d: log write failed\n", dev);
+        abandon_trans(dl);
+        continue;
+      }
+      bsync(dev);
+      write_head(dl);    // Write header to disk -- the real commit
+      bsync(dev);
+      install_trans(dl, 0); // Now install writes to home locations
+      bsync(dev);
+      dl->lh.n = 0;
+      write_head(dl);    // Erase the transaction from the log
+      bsync(dev);
+    }
   }
 }
 
@@ -215,21 +275,22 @@ void
 log_write(struct buf *b)
 {
   int i;
+  struct devlog *dl = &log.dl[b->dev];
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (dl->lh.n >= LOGSIZE || dl->lh.n >= dl->size - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  for (i = 0; i < dl->lh.n; i++) {
+    if (dl->lh.block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  dl->lh.block[i] = b->blockno;
+  if (i == dl->lh.n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    dl->lh.n++;
   }
   release(&log.lock);
 }
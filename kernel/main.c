@@ -29,15 +29,17 @@ main()
     fileinit();      // file table
     virtio_disk_init(VIRTIO0_ID, "program_disk"); // emulated hard disk 0, with programs
 
-    for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++) {
+    // RAID disks: as many as qemu attached, in the slots that follow.
+    for (int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END && virtio_disk_probe(i); i++) {
       char name[30] = {0};
       strcat(name, "disk_");
       itoa(i, 10, name);
-      printf("%s\n", name);
       virtio_disk_init(i, name);
+      printf("%s: %d blocks\n", name, (int) virtio_disk_blocks(i));
     }
 
     userinit();      // first user process
+    raidinit();      // RAID rebuild daemon
     __sync_synchronize();
     started = 1;
   } else {
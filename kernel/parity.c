@@ -0,0 +1,358 @@
+//
+// parity arithmetic for raid.c.
+//
+// xor_blocks() folds any number of BSIZE blocks into a destination
+// block. built with make RVV=1 it uses the RISC-V vector extension,
+// otherwise it works on 64-bit words and makes one pass over the
+// destination per four sources.
+//
+// gen_pq() computes the two RAID6 syndromes, P (XOR) and Q, the
+// Reed-Solomon sum of g^i * D[i] over GF(2^8) with g = {02} and the
+// polynomial x^8+x^4+x^3+x^2+1. Q is evaluated by Horner's rule, so it
+// only ever multiplies by {02}, eight bytes to a word. gf_mul_acc()
+// multiplies by any other constant through two 16-entry nibble tables,
+// and raid6_recover() solves a stripe for up to two lost blocks.
+//
+
+#include "types.h"
+#include "param.h"
+#include "fs.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define WORDS (BSIZE / sizeof(uint64))
+
+static int
+aligned(uchar *p)
+{
+  return ((uint64)p & (sizeof(uint64) - 1)) == 0;
+}
+
+#ifdef __riscv_vector
+// dst ^= src over one block, as many words at a time as the
+// vector unit will take.
+static void
+xor_rvv(uchar *dst, uchar *src)
+{
+  uint64 len = WORDS;
+
+  asm volatile(
+    "1:\n"
+    "vsetvli t0, %0, e64, m8, ta, ma\n"
+    "vle64.v v0, (%1)\n"
+    "vle64.v v8, (%2)\n"
+    "vxor.vv v0, v0, v8\n"
+    "vse64.v v0, (%1)\n"
+    "sub %0, %0, t0\n"
+    "slli t0, t0, 3\n"
+    "add %1, %1, t0\n"
+    "add %2, %2, t0\n"
+    "bnez %0, 1b\n"
+    : "+r" (len), "+r" (dst), "+r" (src)
+    :
+    : "t0", "memory",
+      "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",
+      "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15");
+}
+#endif
+
+// dst ^= s[0] ^ ... ^ s[n-1], n <= 4, a word at a time.
+static void
+xor_words(uint64 *d, uint64 **s, int n)
+{
+  uint64 *s0 = s[0], *s1 = s[1], *s2 = s[2], *s3 = s[3];
+
+  switch(n){
+  case 4:
+    for(int i = 0; i < WORDS; i++)
+      d[i] ^= s0[i] ^ s1[i] ^ s2[i] ^ s3[i];
+    break;
+  case 3:
+    for(int i = 0; i < WORDS; i++)
+      d[i] ^= s0[i] ^ s1[i] ^ s2[i];
+    break;
+  case 2:
+    for(int i = 0; i < WORDS; i += 2){
+      d[i] ^= s0[i] ^ s1[i];
+      d[i+1] ^= s0[i+1] ^ s1[i+1];
+    }
+    break;
+  case 1:
+    for(int i = 0; i < WORDS; i += 4){
+      d[i] ^= s0[i];
+      d[i+1] ^= s0[i+1];
+      d[i+2] ^= s0[i+2];
+      d[i+3] ^= s0[i+3];
+    }
+    break;
+  }
+}
+
+// dst ^= srcs[0] ^ ... ^ srcs[n-1], each a BSIZE block.
+void
+xor_blocks(uchar *dst, uchar **srcs, int n)
+{
+  int ok = aligned(dst);
+
+  for(int i = 0; i < n; i++)
+    ok = ok && aligned(srcs[i]);
+  if(!ok){
+    for(int i = 0; i < n; i++)
+      for(int j = 0; j < BSIZE; j++)
+        dst[j] ^= srcs[i][j];
+    return;
+  }
+
+#ifdef __riscv_vector
+  // the kernel doesn't save vector registers across a context
+  // switch, so keep interrupts off and leave the unit turned
+  // off again for user space.
+  push_off();
+  uint64 sstatus = r_sstatus();
+  w_sstatus((sstatus & ~SSTATUS_VS) | SSTATUS_VS_INITIAL);
+  for(int i = 0; i < n; i++)
+    xor_rvv(dst, srcs[i]);
+  w_sstatus(sstatus);
+  pop_off();
+#else
+  uint64 *s[4] = { 0 };
+
+  for(int i = 0; i < n; i += 4){
+    int m = n - i < 4 ? n - i : 4;
+    for(int j = 0; j < m; j++)
+      s[j] = (uint64*)srcs[i + j];
+    xor_words((uint64*)dst, s, m);
+  }
+#endif
+}
+
+// GF(2^8) log and antilog tables, built by gf_init() at boot,
+// before the other harts start. gf_exp is doubled so a
+// product's exponent never needs reducing.
+static uchar gf_exp[510];
+static uchar gf_log[256];
+
+void
+gf_init(void)
+{
+  int x = 1;
+
+  for(int i = 0; i < 255; i++){
+    gf_exp[i] = gf_exp[i + 255] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if(x & 0x100)
+      x ^= 0x11d;
+  }
+}
+
+static uchar
+gf_mul(uchar a, uchar b)
+{
+  if(a == 0 || b == 0)
+    return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+// g^n.
+uchar
+gf_pow2(int n)
+{
+  return gf_exp[n % 255];
+}
+
+uchar
+gf_inv(uchar a)
+{
+  return gf_exp[255 - gf_log[a]];
+}
+
+// every byte of x times {02}.
+static uint64
+mul2_word(uint64 x)
+{
+  uint64 hi = x & 0x8080808080808080ULL;
+
+  return ((x << 1) & 0xfefefefefefefefeULL) ^ ((hi >> 7) * 0x1d);
+}
+
+static uint64 zero_block[WORDS];
+
+#ifdef __riscv_vector
+// p ^= src and q = q * {02} ^ src over one block, a byte per lane.
+static void
+pq_step_rvv(uchar *p, uchar *q, uchar *src)
+{
+  uint64 len = BSIZE;
+
+  asm volatile(
+    "1:\n"
+    "vsetvli t0, %0, e8, m4, ta, ma\n"
+    "vle8.v v0, (%1)\n"
+    "vle8.v v4, (%2)\n"
+    "vle8.v v8, (%3)\n"
+    "vxor.vv v0, v0, v8\n"
+    "vsra.vi v12, v4, 7\n"
+    "vand.vx v12, v12, %4\n"
+    "vadd.vv v4, v4, v4\n"
+    "vxor.vv v4, v4, v12\n"
+    "vxor.vv v4, v4, v8\n"
+    "vse8.v v0, (%1)\n"
+    "vse8.v v4, (%2)\n"
+    "sub %0, %0, t0\n"
+    "add %1, %1, t0\n"
+    "add %2, %2, t0\n"
+    "add %3, %3, t0\n"
+    "bnez %0, 1b\n"
+    : "+r" (len), "+r" (p), "+r" (q), "+r" (src)
+    : "r" (0x1d)
+    : "t0", "memory",
+      "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",
+      "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15");
+}
+#endif
+
+// p = data[0] ^ ... ^ data[n-1] and q = sum of g^i * data[i]. a null
+// data[i] counts as a block of zeros, a null p or q isn't computed.
+void
+gen_pq(uchar *p, uchar *q, uchar **data, int n)
+{
+  uchar *s[NRAIDDISK];
+  int ok = 1;
+
+  for(int i = 0; i < n; i++){
+    s[i] = data[i] ? data[i] : (uchar*)zero_block;
+    ok = ok && aligned(s[i]);
+  }
+  if(q == 0){
+    memset(p, 0, BSIZE);
+    xor_blocks(p, s, n);
+    return;
+  }
+  ok = ok && aligned(q) && (p == 0 || aligned(p));
+  if(!ok){
+    for(int j = 0; j < BSIZE; j++){
+      uchar pb = 0, qb = 0;
+      for(int i = n - 1; i >= 0; i--){
+        pb ^= s[i][j];
+        qb = ((qb << 1) ^ (qb & 0x80 ? 0x1d : 0)) ^ s[i][j];
+      }
+      if(p)
+        p[j] = pb;
+      q[j] = qb;
+    }
+    return;
+  }
+
+#ifdef __riscv_vector
+  if(p){
+    memset(p, 0, BSIZE);
+    memset(q, 0, BSIZE);
+    push_off();
+    uint64 sstatus = r_sstatus();
+    w_sstatus((sstatus & ~SSTATUS_VS) | SSTATUS_VS_INITIAL);
+    for(int i = n - 1; i >= 0; i--)
+      pq_step_rvv(p, q, s[i]);
+    w_sstatus(sstatus);
+    pop_off();
+    return;
+  }
+#endif
+  uint64 *pw = (uint64*)p, *qw = (uint64*)q;
+  for(int j = 0; j < WORDS; j++){
+    uint64 pv = 0, qv = 0;
+    for(int i = n - 1; i >= 0; i--){
+      uint64 d = ((uint64*)s[i])[j];
+      pv ^= d;
+      qv = mul2_word(qv) ^ d;
+    }
+    if(pw)
+      pw[j] = pv;
+    qw[j] = qv;
+  }
+}
+
+// dst ^= c * src. each product is looked up by nibble, c * x being
+// lo[x & 15] ^ hi[x >> 4].
+void
+gf_mul_acc(uchar *dst, uchar *src, uchar c)
+{
+  uchar lo[16], hi[16];
+
+  for(int i = 0; i < 16; i++){
+    lo[i] = gf_mul(c, i);
+    hi[i] = gf_mul(c, i << 4);
+  }
+  for(int j = 0; j < BSIZE; j++)
+    dst[j] ^= lo[src[j] & 15] ^ hi[src[j] >> 4];
+}
+
+// b[0 .. k) are the data blocks of a RAID6 stripe, b[k] its P and
+// b[k+1] its Q. slots x and y (y < 0 if only one, else x < y) are lost;
+// recompute them from the rest. every slot is right on return.
+void
+raid6_recover(uchar **b, int k, int x, int y)
+{
+  uchar *p = b[k], *q = b[k + 1], *dx = b[x];
+
+  if(x >= k){
+    // only parity lost.
+    if(y < 0)
+      gen_pq(x == k ? p : 0, x == k ? 0 : q, b, k);
+    else
+      gen_pq(p, q, b, k);
+    return;
+  }
+  if(y < 0 || y == k + 1){
+    // D[x] from P, then Q if that went too.
+    uchar *s[NRAIDDISK];
+    int n = 0;
+    for(int i = 0; i < k; i++)
+      if(i != x)
+        s[n++] = b[i];
+    memmove(dx, p, BSIZE);
+    xor_blocks(dx, s, n);
+    if(y == k + 1)
+      gen_pq(0, q, b, k);
+    return;
+  }
+  if(y == k){
+    // D[x] and P: g^x * D[x] = Q ^ Q', Q' from the other data.
+    b[x] = 0;
+    gen_pq(0, p, b, k);
+    xor_blocks(p, &q, 1);
+    memset(dx, 0, BSIZE);
+    gf_mul_acc(dx, p, gf_inv(gf_pow2(x)));
+    b[x] = dx;
+    gen_pq(p, 0, b, k);
+    return;
+  }
+
+  // D[x] and D[y]. with Pxy = P ^ P' = D[x] ^ D[y] and
+  // Qxy = Q ^ Q' = g^x D[x] ^ g^y D[y],
+  //   D[x] = A * Pxy ^ B * Qxy, D[y] = Pxy ^ D[x],
+  // A = g^(y-x) / (g^(y-x) ^ 1), B = g^-x / (g^(y-x) ^ 1).
+  uchar *dy = b[y];
+  b[x] = b[y] = 0;
+  gen_pq(dx, dy, b, k);
+  b[x] = dx;
+  b[y] = dy;
+  xor_blocks(dx, &p, 1);
+  xor_blocks(dy, &q, 1);
+  uchar gyx = gf_pow2(y - x);
+  uchar den = gf_inv(gyx ^ 1);
+  uchar a = gf_mul(gyx, den), bb = gf_mul(gf_inv(gf_pow2(x)), den);
+  uchar alo[16], ahi[16], blo[16], bhi[16];
+  for(int i = 0; i < 16; i++){
+    alo[i] = gf_mul(a, i);
+    ahi[i] = gf_mul(a, i << 4);
+    blo[i] = gf_mul(bb, i);
+    bhi[i] = gf_mul(bb, i << 4);
+  }
+  for(int j = 0; j < BSIZE; j++){
+    uchar pxy = dx[j], qxy = dy[j];
+    uchar d = alo[pxy & 15] ^ ahi[pxy >> 4] ^ blo[qxy & 15] ^ bhi[qxy >> 4];
+    dx[j] = d;
+    dy[j] = pxy ^ d;
+  }
+}
@@ -16,6 +16,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -168,6 +169,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -254,6 +256,29 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel thread running fn(). It never enters user
+// space, keeps running in the kernel's address space, and
+// fn must never return.
+int
+kthread_create(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  p->state = RUNNABLE;
+  int pid = p->pid;
+
+  release(&p->lock);
+
+  return pid;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -525,11 +550,24 @@ forkret(void)
     // be run from main().
     first = 0;
     fsinit(ROOTDEV);
+    raid_assemble();
   }
 
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kthreadret");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -1,15 +1,36 @@
 #include "types.h"
+#include "param.h"
 #include "virtio.h"
 #include "raid.h"
-#include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "fs.h"
+#include "buf.h"
 #include "riscv.h"
 #include "memlayout.h"
 #include "proc.h"
 #include "defs.h"
 
-#define RAID_DISK_NUMBER (VIRTIO_RAID_DISK_END)
+#define RAID_DISK_NUMBER (VIRTIO_RAID_DISK_END) // most members an array can have
+#define RAID_DISK_BLOCKS (raid_data.disk_blocks) // blocks of each member the array uses
+#define RAID_MEMBER_MAX (0x7fffffff / RAID_DISK_NUMBER) // most of them, so logical block numbers fit an int
+#define RAID_SB_BLOCKS 2 // blocks at the start of each member kept for its superblock and reshape backup
+#define RAID_BACKUP_BLOCK 1 // where a reshape keeps the row it is moving
+#define RAID_DISK_ROWS (RAID_DISK_BLOCKS - RAID_SB_BLOCKS) // data blocks per member
+#define RAID_SB_CHECKPOINT 64 // rebuilt rows between superblock updates
+#define RAID_BITMAP_BITS (RAID_BITMAP_BYTES * 8)
+#define RAID_REGION_MIN 8 // fewest rows a write-intent bitmap bit stands for
+#define RAID_REGION_ROWS ((RAID_DISK_ROWS + RAID_BITMAP_BITS - 1) / RAID_BITMAP_BITS > RAID_REGION_MIN ? \
+                          (RAID_DISK_ROWS + RAID_BITMAP_BITS - 1) / RAID_BITMAP_BITS : RAID_REGION_MIN)
+#define RAID_BITMAP_DELAY 50 // ticks without new writes before raidd clears the bitmap
+#define BLOCKS_PER_PAGE (PGSIZE / BSIZE)
+#define RAID_STRIPE_CACHE 16 // stripe cache entries, each with the stripe lock of the rows it takes
+#define RAID_CACHE_DELAY 10 // ticks a row stays dirty in the stripe cache before raidd writes it back
+#define RAID_SCRUB_RATE 2 // rows scrubbed per clock tick at most
+#define RAID_BATCH 32 // disk requests in flight per multi-block batch
+#define RAID_READ_RUN 8 // rows of a sequential read one mirror serves before another joins in
+#define RAID_BATCH_DISK(d) (1UL << (32 + (d))) // lock_batch() took disk d's lock
+#define RAID_MTIME_HZ 10000000 // CLINT mtime ticks a second, on qemu's virt machine
 
 struct raid_lock{
     struct spinlock lock;
@@ -17,17 +38,100 @@ struct raid_lock{
     int readers;
 };
 
-static struct raid{
+// How an array lays its blocks out.
+struct raid_geom{
     enum RAID_TYPE type;
-   uint16 numberOfBlocks;
+    int ndisks; // members, disks 1 .. ndisks
+    int chunk;  // stripe unit, in blocks
+};
+
+// One entry of the stripe cache: the blocks of a row of a parity level,
+// data slots 0 .. k - 1 followed by P and, on RAID6, Q.
+struct stripe_head{
+    struct raid_lock lock; // stripe lock of the rows that map here
+    int row;               // -1 if none
+    uint valid;            // bit s set if blocks[s] holds slot s
+    uint dirty;            // bit s set if blocks[s] is newer than the disk
+    uint dirty_ticks;      // when it last went from clean to dirty
+    uchar blocks[RAID_DISK_NUMBER][BSIZE];
+};
+
+static struct raid{
+   struct raid_geom geom; // the layout, or the one a reshape is moving to
+   uint numberOfBlocks;
+   uint disk_blocks; // the smallest member's capacity when the array was made
    int failed[RAID_DISK_NUMBER + 1]; // 0 false, 1 true
+   // Members are numbered 1 .. geom.ndisks, and member i is on disk
+   // dev[i]. Disks in the spares mask (bit d for disk d) stand by to
+   // take the place of a member that fails. Changed under array_lock
+   // held exclusively.
+   int dev[RAID_DISK_NUMBER + 1];
+   uint spares;
    int booted; // 0 false, 1 true
    struct raid_lock locks[RAID_DISK_NUMBER + 1];
+   // Parity level I/O holds array_lock shared and the lock of each stripe
+   // it touches; disk failure and repair take array_lock exclusively.
+   struct raid_lock array_lock;
+   struct stripe_head cache[RAID_STRIPE_CACHE];
+   int cache_dirty; // entries holding dirty blocks, under daemon_lock
+   // Background rebuild, run by raidd: rebuild_disk (0 if none) has been
+   // rebuilt up to, not including, row rebuild_cursor and is written
+   // through below it. Changed under array_lock and daemon_lock, the
+   // cursor also under the lock of the row it passes. rebuild_rate caps
+   // the rows rebuilt per clock tick, 0 meaning as fast as possible.
+   struct spinlock daemon_lock;
+   int rebuild_disk;
+   int rebuild_cursor;
+   int rebuild_running; // 0 when no rebuild or paused
+   int rebuild_rate;
+   int rebuild_partial; // rebuild only the regions set in the bitmap
+   int resync_running; // bringing the members of dirty regions back in line
+   int resync_cursor;
+   // Scrub, run by raidd when it has nothing more urgent to do: rows
+   // below scrub_cursor have been checked in the current pass. The
+   // counters are for that pass, or the last one.
+   int scrub_running;
+   int scrub_repair; // fix mismatches, not just count them
+   int scrub_cursor;
+   uint scrub_checked;
+   uint scrub_mismatches;
+   uint scrub_repaired;
+   // Reshape, run by raidd: rows below reshape_row have been moved to
+   // geom, the rest are still laid out as old, which is geom when there
+   // is no reshape. Changed under array_lock held exclusively, the
+   // running flag also under daemon_lock.
+   struct raid_geom old;
+   int reshaping;
+   int reshape_running; // 0 when paused, as while the array is degraded
+   int reshape_row;
+   int reshape_backup; // the backup blocks hold row reshape_row - 1
+   // Read balancing hints for the mirrored levels, kept without locks:
+   // reads in flight on each disk, the row it read last, and how long
+   // the sequential run that ended there is.
+   int reads_inflight[RAID_DISK_NUMBER + 1];
+   int last_row[RAID_DISK_NUMBER + 1];
+   int run[RAID_DISK_NUMBER + 1];
+   uint next_mirror; // round robin among otherwise equal mirrors
+   // identity of the array on disk, see struct raid_super.
+   uint64 uuid;
+   uint64 events;
+   // Write-intent bitmap. Bit r set means rows of region r may differ
+   // between members. A region's bit is on disk before any write to it
+   // is issued, and raidd clears them all once the array is whole and
+   // writes have stopped for RAID_BITMAP_DELAY ticks. bitmap is what
+   // the superblocks hold, bitmap_next what the next update writes.
+   struct sleeplock sb_lock; // serializes superblock updates
+   uchar bitmap[RAID_BITMAP_BYTES];
+   uchar bitmap_next[RAID_BITMAP_BYTES];
+   int bitmap_dirty;
+   uint bitmap_ticks; // when a write was last marked
+   uint64 bitmap_events; // events of the update that last cleared it
+   // I/O statistics, bumped atomically without locks; see
+   // sys_stat_raid_impl().
+   struct raid_stat stats;
 }raid_data;
 //static struct raid raid_data;
 
-uchar parity_buffer[BSIZE];
-
 void raid_lock_read_acquire(struct raid_lock* rl){
     acquire(&rl->lock);
     while(rl->writers > 0) sleep(rl, &rl->lock);
@@ -56,43 +160,610 @@ void raid_lock_write_release(struct raid_lock* rl){
     release(&rl->lock);
 }
 
-void copy_disk_data(int src, int dst){
-    uchar buff[BSIZE];
-    raid_lock_read_acquire(&raid_data.locks[src]);
-    raid_lock_write_acquire(&raid_data.locks[dst]);
-    for(int i = 0; i < raid_data.numberOfBlocks / RAID_DISK_NUMBER; i++){
-        read_block(src, i, buff);
-        write_block(dst, i, buff);
+static struct stripe_head* cache_of(int row){
+    return &raid_data.cache[row % RAID_STRIPE_CACHE];
+}
+
+static struct raid_lock* stripe_lock(int row){
+    return &cache_of(row)->lock;
+}
+
+// Can disk diskNum serve row blkNum? A disk that is being rebuilt can,
+// for the rows the rebuild has already passed.
+static int disk_ok(int diskNum, int blkNum){
+    if(!raid_data.failed[diskNum]) return 1;
+    return diskNum == raid_data.rebuild_disk && blkNum < raid_data.rebuild_cursor;
+}
+
+// Count one op of kind op that began at start, mtime().
+static void stat_time(int op, uint64 start){
+    uint64 d = mtime() - start;
+    int b = 0;
+    while((d >> (b + 1)) != 0 && b < RAID_STAT_BUCKETS - 1)
+        b++;
+    __sync_fetch_and_add(&raid_data.stats.ops[op], 1);
+    __sync_fetch_and_add(&raid_data.stats.ticks[op], d);
+    __sync_fetch_and_add(&raid_data.stats.hist[op][b], 1);
+}
+
+// Carry out requests reqs[0 .. n), counting them against their disks.
+static void raid_rw(struct disk_req* reqs, int n){
+    rw_blocks(reqs, n);
+    for(int i = 0; i < n; i++){
+        struct raid_disk_stat* ds = &raid_data.stats.disk[reqs[i].diskn];
+        if(reqs[i].write){
+            __sync_fetch_and_add(&ds->writes, 1);
+            __sync_fetch_and_add(&ds->write_bytes, BSIZE);
+        }else{
+            __sync_fetch_and_add(&ds->reads, 1);
+            __sync_fetch_and_add(&ds->read_bytes, BSIZE);
+        }
     }
-    raid_lock_read_release(&raid_data.locks[src]);
-    raid_lock_write_release(&raid_data.locks[dst]);
+}
 
+// A request for row blockno of member diskn.
+static void set_req(struct disk_req* r, int diskn, int blockno, uchar* data, int write){
+    r->diskn = raid_data.dev[diskn];
+    r->blockno = blockno + RAID_SB_BLOCKS;
+    r->data = data;
+    r->write = write;
 }
 
-int sys_init_raid_impl(enum RAID_TYPE raid){
-    if(raid_data.booted) return -1;
+static void scratch_put(uchar** blks, int n){
+    for(int i = 0; i < n; i += BLOCKS_PER_PAGE)
+        kfree(blks[i]);
+}
 
-    raid_data.type = raid;
-    raid_data.booted = 1;
-    for(int i = 1; i <= RAID_DISK_NUMBER; i++)
-        raid_data.failed[i] = 0;
-    switch(raid){
+// Scratch blocks for one RAID operation. The kernel stack is a single
+// page, so stripes are staged in kalloc()ed pages instead, each one
+// carved into BLOCKS_PER_PAGE blocks.
+static int scratch_get(uchar** blks, int n){
+    for(int i = 0; i < n; i++){
+        if(i % BLOCKS_PER_PAGE){
+            blks[i] = blks[i - 1] + BSIZE;
+            continue;
+        }
+        if((blks[i] = kalloc()) == 0){
+            scratch_put(blks, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int parity_level(struct raid_geom* g){
+    return g->type == RAID4 || g->type == RAID5 || g->type == RAID6;
+}
+
+// Data blocks per stripe of a parity level.
+static int data_disks(struct raid_geom* g){
+    return g->ndisks - (g->type == RAID6 ? 2 : 1);
+}
+
+// How many disks a stripe spreads its data chunks over.
+static int stripe_width(struct raid_geom* g){
+    switch(g->type){
         case RAID0:
-            raid_data.numberOfBlocks = RAID_DISK_NUMBER * VIRTIO_RAID_DISK_SIZE / BSIZE;
-            break;
-        case RAID1:
-            raid_data.numberOfBlocks = VIRTIO_RAID_DISK_SIZE / BSIZE;
-            break;
+            return g->ndisks;
         case RAID0_1:
-            raid_data.numberOfBlocks = RAID_DISK_NUMBER / 2 * VIRTIO_RAID_DISK_SIZE / BSIZE;
-            break;
-        case RAID4:
-            raid_data.numberOfBlocks = (RAID_DISK_NUMBER - 1) * VIRTIO_RAID_DISK_SIZE / BSIZE;
-            break;
-        case RAID5:
-            raid_data.numberOfBlocks = (RAID_DISK_NUMBER - 1) * VIRTIO_RAID_DISK_SIZE / BSIZE;
-            break;
+            return g->ndisks / 2;
+        case RAID1:
+            return 1;
+        default:
+            return data_disks(g);
+    }
+}
+
+// The layout row is in: the old one until a reshape gets to it.
+static struct raid_geom* row_geom(int row){
+    if(raid_data.reshaping && row >= raid_data.reshape_row) return &raid_data.old;
+    return &raid_data.geom;
+}
+
+// The layout logical block blkn is in. A reshape only runs with a chunk
+// of one block, so the rows it has moved hold the first
+// reshape_row * stripe_width() blocks.
+static struct raid_geom* blk_geom(int blkn){
+    if(raid_data.reshaping && blkn >= raid_data.reshape_row * stripe_width(&raid_data.geom))
+        return &raid_data.old;
+    return &raid_data.geom;
+}
+
+// XOR together block blkNum of every member except skip1 and skip2
+// (0 skips nothing) into out. All of the reads are in flight at once.
+// Returns -1 if one of the members it needs has failed.
+static int stripe_xor(int blkNum, int skip1, int skip2, uchar* out){
+    uchar* blks[RAID_DISK_NUMBER];
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    int ndisks = row_geom(blkNum)->ndisks, n = 0;
+
+    for(int i = 1; i < ndisks + 1; i++){
+        if(i == skip1 || i == skip2) continue;
+        if(!disk_ok(i, blkNum)) return -1;
+        n++;
+    }
+    if(scratch_get(blks, n) < 0) return -1;
+    n = 0;
+    for(int i = 1; i < ndisks + 1; i++){
+        if(i == skip1 || i == skip2) continue;
+        set_req(&reqs[n], i, blkNum, blks[n], 0);
+        n++;
+    }
+    raid_rw(reqs, n);
+
+    memset(out, 0, BSIZE);
+    xor_blocks(out, blks, n);
+    scratch_put(blks, n);
+    return 0;
+}
+
+// RAID4 keeps parity on the last disk. RAID5 rotates it across the
+// disks, one stripe (chunk rows) at a time, and lays the data chunks of
+// a stripe out on the disks that follow its parity disk
+// (left-symmetric). RAID6 does the same with P, puts Q on the disk
+// after it, and the data after Q.
+static int parity_disk_of(int row){
+    struct raid_geom* g = row_geom(row);
+    if(g->type == RAID4) return g->ndisks;
+    return row / g->chunk % g->ndisks + 1;
+}
+
+static int q_disk_of(int row){
+    return parity_disk_of(row) % row_geom(row)->ndisks + 1;
+}
+
+// The disk holding data chunk k, 0 <= k < data_disks(), of the stripe
+// that row is in.
+static int data_disk_of(int row, int k){
+    struct raid_geom* g = row_geom(row);
+    if(g->type == RAID4) return k + 1;
+    if(g->type == RAID6) return (q_disk_of(row) + k) % g->ndisks + 1;
+    return (parity_disk_of(row) + k) % g->ndisks + 1;
+}
+
+// The disk in slot s of a RAID6 stripe: data block s for s < k, then
+// P, then Q.
+static int slot_disk(int stripe, int s){
+    int k = data_disks(row_geom(stripe));
+    if(s < k) return data_disk_of(stripe, s);
+    return s == k ? parity_disk_of(stripe) : q_disk_of(stripe);
+}
+
+// Read RAID6 stripe `stripe` into blks, one block per slot, and
+// recompute the slots on disks that can't serve it. Fails if more than
+// two are missing.
+static int stripe_read6(int stripe, uchar** blks){
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    int k = data_disks(row_geom(stripe)), miss[2], nmiss = 0, n = 0;
+
+    for(int s = 0; s < k + 2; s++){
+        int diskNum = slot_disk(stripe, s);
+        if(disk_ok(diskNum, stripe)){
+            set_req(&reqs[n++], diskNum, stripe, blks[s], 0);
+        }else{
+            if(nmiss == 2) return -1;
+            miss[nmiss++] = s;
+        }
+    }
+    raid_rw(reqs, n);
+    if(nmiss > 0)
+        raid6_recover(blks, k, miss[0], nmiss == 2 ? miss[1] : -1);
+    return 0;
+}
+
+// Recompute block stripe of disk diskn from the rest of its stripe. On
+// RAID6 a data or P block XORs back out of the others as long as only
+// it is missing from them; anything else takes the whole stripe.
+static int recover_block(int stripe, int diskn, uchar* out){
+    uchar* blks[RAID_DISK_NUMBER];
+    int k = data_disks(row_geom(stripe));
+
+    if(row_geom(stripe)->type != RAID6)
+        return stripe_xor(stripe, diskn, 0, out);
+    if(diskn != q_disk_of(stripe) && stripe_xor(stripe, diskn, q_disk_of(stripe), out) == 0)
+        return 0;
+    if(scratch_get(blks, k + 2) < 0) return -1;
+    int ret = stripe_read6(stripe, blks);
+    if(ret == 0){
+        for(int s = 0; s < k + 2; s++){
+            if(slot_disk(stripe, s) == diskn)
+                memmove(out, blks[s], BSIZE);
+        }
+    }
+    scratch_put(blks, k + 2);
+    return ret;
+}
+
+// Stripe cache. The rows of a parity level written lately stay in
+// memory, so writing them again takes no reads and only updates the
+// cached parity. Writes are held back: the dirty blocks of a row go out
+// together, with their parity, when its entry is taken for another row
+// or when raidd finds them dirty for RAID_CACHE_DELAY ticks. Row r can
+// only use entry r % RAID_STRIPE_CACHE, whose lock is r's stripe lock.
+// A block on disk is current unless the cache holds it dirty, and the
+// blocks of a row on disk always agree with their parity, so anything
+// the cache doesn't hold can still be recovered from the disks.
+
+// Write the dirty blocks of sh to the members that are up. The caller
+// holds its lock for writing.
+static void cache_flush(struct stripe_head* sh){
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    int n = 0;
+
+    if(sh->dirty == 0) return;
+    for(int s = 0; s < row_geom(sh->row)->ndisks; s++){
+        int diskNum = slot_disk(sh->row, s);
+        if((sh->dirty & (1 << s)) && disk_ok(diskNum, sh->row))
+            set_req(&reqs[n++], diskNum, sh->row, sh->blocks[s], 1);
+    }
+    raid_rw(reqs, n);
+    sh->dirty = 0;
+    acquire(&raid_data.daemon_lock);
+    raid_data.cache_dirty--;
+    release(&raid_data.daemon_lock);
+}
+
+static void cache_mark(struct stripe_head* sh, uint slots){
+    if(sh->dirty == 0){
+        sh->dirty_ticks = ticks;
+        acquire(&raid_data.daemon_lock);
+        raid_data.cache_dirty++;
+        wakeup(&raid_data.rebuild_running);
+        release(&raid_data.daemon_lock);
+    }
+    sh->dirty |= slots;
+}
+
+// The entry for row, written back and taken over from the row it held
+// before if need be.
+static struct stripe_head* cache_get(int row){
+    struct stripe_head* sh = cache_of(row);
+    if(sh->row != row){
+        cache_flush(sh);
+        sh->row = row;
+        sh->valid = 0;
+    }
+    return sh;
+}
+
+// Forget what the cache holds of row, after writing it back.
+static void cache_drop(int row){
+    struct stripe_head* sh = cache_of(row);
+    if(sh->row == row){
+        cache_flush(sh);
+        sh->row = -1;
+        sh->valid = 0;
+    }
+}
+
+// Empty the cache, throwing away anything dirty. Only when no I/O can
+// be using it.
+static void cache_reset(void){
+    for(int i = 0; i < RAID_STRIPE_CACHE; i++){
+        raid_data.cache[i].row = -1;
+        raid_data.cache[i].valid = 0;
+        raid_data.cache[i].dirty = 0;
+    }
+    acquire(&raid_data.daemon_lock);
+    raid_data.cache_dirty = 0;
+    release(&raid_data.daemon_lock);
+}
+
+// The reads bringing slots into sh costs: one per block not cached, a
+// whole row for one on a failed disk.
+static int fill_cost(struct stripe_head* sh, uint slots){
+    int n = row_geom(sh->row)->ndisks, cost = 0;
+    for(int s = 0; s < n; s++){
+        if(!(slots & (1 << s)) || (sh->valid & (1 << s))) continue;
+        cost += disk_ok(slot_disk(sh->row, s), sh->row) ? 1 : n;
+    }
+    return cost;
+}
+
+// Recompute the slots in missing, on failed disks, from the rest of
+// the row, which the cache holds.
+static int cache_recover(struct stripe_head* sh, uint missing){
+    uchar* b[RAID_DISK_NUMBER];
+    struct raid_geom* g = row_geom(sh->row);
+    int k = data_disks(g), x = -1, y = -1, n = 0;
+
+    for(int s = 0; s < g->ndisks; s++){
+        if(!(missing & (1 << s))) continue;
+        if(y >= 0 || (x >= 0 && g->type != RAID6)) return -1;
+        if(x < 0) x = s;
+        else y = s;
+    }
+    if(g->type == RAID6){
+        for(int s = 0; s < g->ndisks; s++)
+            b[s] = sh->blocks[s];
+        raid6_recover(b, k, x, y);
+    }else{
+        for(int s = 0; s < g->ndisks; s++){
+            if(s != x) b[n++] = sh->blocks[s];
+        }
+        memset(sh->blocks[x], 0, BSIZE);
+        xor_blocks(sh->blocks[x], b, n);
+    }
+    sh->valid |= missing;
+    return 0;
+}
+
+// Bring slots into sh, the reads all in flight at once, then recover
+// the ones on failed disks: in memory if that filled the rest of the
+// row, otherwise from the disks.
+static int cache_fill(struct stripe_head* sh, uint slots){
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    int ndisks = row_geom(sh->row)->ndisks, n = 0;
+    uint missing = 0, all = (1 << ndisks) - 1;
+
+    slots &= ~sh->valid;
+    for(int s = 0; s < ndisks; s++){
+        if(!(slots & (1 << s))) continue;
+        int diskNum = slot_disk(sh->row, s);
+        if(disk_ok(diskNum, sh->row)) set_req(&reqs[n++], diskNum, sh->row, sh->blocks[s], 0);
+        else missing |= 1 << s;
+    }
+    raid_rw(reqs, n);
+    sh->valid |= slots & ~missing;
+    if(missing && (sh->valid | missing) == all)
+        return cache_recover(sh, missing);
+    for(int s = 0; s < ndisks; s++){
+        if(!(missing & (1 << s))) continue;
+        if(recover_block(sh->row, slot_disk(sh->row, s), sh->blocks[s]) < 0) return -1;
+        sh->valid |= 1 << s;
+    }
+    return 0;
+}
+
+// Write data blocks first .. first + m - 1 of row into the stripe cache
+// and bring the cached parity up to date, with as few reads as
+// possible: either the old contents of the blocks being replaced and
+// the parity (read-modify-write), or the blocks being kept
+// (reconstruct-write), counting what the cache already holds. A row
+// written over in full, or written again, costs no reads. The caller
+// holds the row's stripe lock for writing.
+static int write_stripe(int row, int first, int m, uchar** data){
+    struct raid_geom* g = row_geom(row);
+    int k = data_disks(g), nfailed = 0;
+    uint all = (1 << k) - 1, parity = ((1 << g->ndisks) - 1) & ~all;
+    uint touched = ((1 << m) - 1) << first;
+    uchar* srcs[RAID_DISK_NUMBER];
+
+    for(int s = 0; s < g->ndisks; s++){
+        if(!disk_ok(slot_disk(row, s), row)) nfailed++;
     }
+    if(nfailed > g->ndisks - k) return -1;
+    struct stripe_head* sh = cache_get(row);
+    int rmw = fill_cost(sh, touched | parity) < fill_cost(sh, all & ~touched);
+    __sync_fetch_and_add(rmw ? &raid_data.stats.rmw : &raid_data.stats.rcw, 1);
+    if(cache_fill(sh, rmw ? touched | parity : all & ~touched) < 0) return -1;
+
+    uchar* p = sh->blocks[k];
+    uchar* q = g->type == RAID6 ? sh->blocks[k + 1] : 0;
+    for(int i = first; i < first + m; i++){
+        if(rmw){
+            // fold old ^ new into P, and times g^i into Q.
+            uchar* delta = sh->blocks[i];
+            xor_blocks(delta, &data[i - first], 1);
+            xor_blocks(p, &delta, 1);
+            if(q) gf_mul_acc(q, delta, gf_pow2(i));
+        }
+        memmove(sh->blocks[i], data[i - first], BSIZE);
+    }
+    if(!rmw){
+        for(int i = 0; i < k; i++)
+            srcs[i] = sh->blocks[i];
+        gen_pq(p, q, srcs, k);
+    }
+    sh->valid |= touched | parity;
+    cache_mark(sh, touched | parity);
+    return 0;
+}
+
+// Superblocks. Every member keeps one in block 0 describing the array
+// and its place in it, block 1 being kept for a reshape's backup. They
+// are all rewritten, with a higher events count, whenever the array's
+// state changes, so at boot the newest copy tells the truth and a
+// member holding an older one missed an update.
+
+_Static_assert(sizeof(struct raid_super) <= BSIZE, "struct raid_super must fit in a block");
+
+static uint sb_checksum(struct raid_super* sb){
+    uint* w = (uint*) sb;
+    uint sum = 0;
+    for(; w < &sb->checksum; w++)
+        sum = ((sum << 5) | (sum >> 27)) ^ *w;
+    return sum;
+}
+
+static int sb_valid(struct raid_super* sb, int diskn){
+    return sb->magic == RAID_SB_MAGIC && sb->version == RAID_SB_VERSION &&
+           sb->ndisks <= RAID_DISK_NUMBER && sb->index <= sb->ndisks &&
+           (sb->index ? sb->dev[sb->index] == diskn : (sb->spares & (1 << diskn)) != 0) &&
+           sb->disk_blocks > RAID_SB_BLOCKS && sb->disk_blocks <= virtio_disk_blocks(diskn) &&
+           sb->level <= RAID6 && sb->chunk >= 1 && sb->chunk <= sb->disk_blocks - RAID_SB_BLOCKS &&
+           (!sb->reshaping || (sb->old_level <= RAID6 && sb->old_ndisks <= sb->ndisks &&
+                               sb->reshape_row <= sb->disk_blocks - RAID_SB_BLOCKS)) &&
+           sb->checksum == sb_checksum(sb);
+}
+
+// Write the current state to the superblock of every member that is
+// up or being rebuilt and of every spare, or wipe them if clear is set.
+// The caller holds sb_lock.
+static void sb_update(int clear){
+    uchar* blks[RAID_DISK_NUMBER];
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    int n = 0;
+
+    if(scratch_get(blks, RAID_DISK_NUMBER) < 0){
+        printf("raid: no memory to write superblocks\n");
+        return;
+    }
+    raid_data.events++;
+    // members first, then spares, which get index 0.
+    for(int i = 1; i <= raid_data.geom.ndisks + RAID_DISK_NUMBER; i++){
+        int d = i <= raid_data.geom.ndisks ? raid_data.dev[i] : i - raid_data.geom.ndisks;
+        if(i <= raid_data.geom.ndisks && raid_data.failed[i] && i != raid_data.rebuild_disk) continue;
+        if(i > raid_data.geom.ndisks && !(raid_data.spares & (1 << d))) continue;
+        struct raid_super* sb = (struct raid_super*) blks[n];
+        memset(sb, 0, BSIZE);
+        if(!clear){
+            sb->magic = RAID_SB_MAGIC;
+            sb->version = RAID_SB_VERSION;
+            sb->level = raid_data.geom.type;
+            sb->ndisks = raid_data.geom.ndisks;
+            sb->chunk = raid_data.geom.chunk;
+            sb->disk_blocks = raid_data.disk_blocks;
+            sb->index = i <= raid_data.geom.ndisks ? i : 0;
+            for(int j = 1; j <= raid_data.geom.ndisks; j++)
+                sb->dev[j] = raid_data.dev[j];
+            sb->spares = raid_data.spares;
+            sb->uuid = raid_data.uuid;
+            sb->events = raid_data.events;
+            for(int j = 1; j <= raid_data.geom.ndisks; j++){
+                if(raid_data.failed[j]) sb->failed |= 1 << j;
+            }
+            sb->rebuild_disk = raid_data.rebuild_disk;
+            sb->rebuild_cursor = raid_data.rebuild_cursor;
+            sb->rebuild_partial = raid_data.rebuild_partial;
+            sb->bitmap_events = raid_data.bitmap_events;
+            memmove(sb->bitmap, raid_data.bitmap_next, RAID_BITMAP_BYTES);
+            sb->reshaping = raid_data.reshaping;
+            sb->old_level = raid_data.old.type;
+            sb->old_ndisks = raid_data.old.ndisks;
+            sb->reshape_row = raid_data.reshape_row;
+            sb->reshape_backup = raid_data.reshape_backup;
+            sb->checksum = sb_checksum(sb);
+        }
+        // block 0 itself, below the data rows set_req() maps to.
+        reqs[n].diskn = d;
+        reqs[n].blockno = 0;
+        reqs[n].data = blks[n];
+        reqs[n].write = 1;
+        n++;
+    }
+    raid_rw(reqs, n);
+    memmove(raid_data.bitmap, raid_data.bitmap_next, RAID_BITMAP_BYTES);
+    scratch_put(blks, RAID_DISK_NUMBER);
+}
+
+static void sb_write_all(void){
+    acquiresleep(&raid_data.sb_lock);
+    sb_update(0);
+    releasesleep(&raid_data.sb_lock);
+}
+
+static int region_dirty(int row){
+    int r = row / RAID_REGION_ROWS;
+    return raid_data.bitmap[r / 8] & (1 << (r % 8));
+}
+
+static int degraded(void){
+    for(int i = 1; i <= raid_data.geom.ndisks; i++){
+        if(raid_data.failed[i]) return 1;
+    }
+    return 0;
+}
+
+// Put the lowest spare in the place of the first failed member and have
+// raidd rebuild it there, unless a rebuild is already under way. The
+// caller holds array_lock exclusively and daemon_lock, and writes the
+// superblocks after.
+static void spare_takeover(void){
+    int m, d;
+
+    if(raid_data.geom.type == RAID0 || raid_data.old.type == RAID0 || raid_data.rebuild_disk) return;
+    for(m = 1; m <= raid_data.geom.ndisks && !raid_data.failed[m]; m++)
+        ;
+    for(d = 1; d <= RAID_DISK_NUMBER && !(raid_data.spares & (1 << d)); d++)
+        ;
+    if(m > raid_data.geom.ndisks || d > RAID_DISK_NUMBER) return;
+    raid_data.spares &= ~(1 << d);
+    raid_data.dev[m] = d;
+    raid_data.rebuild_disk = m;
+    raid_data.rebuild_cursor = 0;
+    raid_data.rebuild_partial = 0;
+    raid_data.rebuild_running = 1;
+    wakeup(&raid_data.rebuild_running);
+    printf("raid: spare disk %d takes the place of member %d\n", d, m);
+}
+
+// Rows first .. last are about to be written: make sure the bitmap on
+// disk covers them. Only the first write to a clean region pays for a
+// superblock update. The caller holds array_lock shared, so the bitmap
+// is not cleared under it.
+static void bitmap_mark(int first, int last){
+    int r, n = 0;
+
+    if(raid_data.geom.type == RAID0 && raid_data.old.type == RAID0) return;
+    raid_data.bitmap_ticks = ticks;
+    for(r = first / RAID_REGION_ROWS; r <= last / RAID_REGION_ROWS; r++){
+        if(!(raid_data.bitmap[r / 8] & (1 << (r % 8)))) break;
+    }
+    if(r > last / RAID_REGION_ROWS) return;
+
+    acquiresleep(&raid_data.sb_lock);
+    for(r = first / RAID_REGION_ROWS; r <= last / RAID_REGION_ROWS; r++){
+        if(!(raid_data.bitmap[r / 8] & (1 << (r % 8)))){
+            raid_data.bitmap_next[r / 8] |= 1 << (r % 8);
+            n++;
+        }
+    }
+    // someone else's update may have covered them meanwhile.
+    if(n > 0){
+        sb_update(0);
+        acquire(&raid_data.daemon_lock);
+        raid_data.bitmap_dirty = 1;
+        wakeup(&raid_data.rebuild_running);
+        release(&raid_data.daemon_lock);
+    }
+    releasesleep(&raid_data.sb_lock);
+}
+
+// A new array gets a new identity, so members of an older one are not
+// mistaken for its own. There is no clock to draw one from, so mix the
+// tick count into the previous one.
+static uint64 new_uuid(void){
+    uint64 x = raid_data.uuid + ticks + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Bring up an array of type raid over disks 1 .. ndisks in memory, all
+// members healthy, using blocks blocks of each.
+static void raid_setup(enum RAID_TYPE raid, int chunk, int ndisks, uint blocks){
+    raid_data.disk_blocks = blocks;
+    raid_data.geom.type = raid;
+    raid_data.geom.ndisks = ndisks;
+    raid_data.geom.chunk = raid == RAID1 ? 1 : chunk;
+    raid_data.old = raid_data.geom;
+    raid_data.reshaping = 0;
+    raid_data.reshape_running = 0;
+    raid_data.reshape_row = 0;
+    raid_data.reshape_backup = 0;
+    raid_data.rebuild_partial = 0;
+    raid_data.resync_running = 0;
+    raid_data.resync_cursor = 0;
+    raid_data.scrub_running = 0;
+    raid_data.scrub_cursor = 0;
+    memset(raid_data.bitmap, 0, RAID_BITMAP_BYTES);
+    memset(raid_data.bitmap_next, 0, RAID_BITMAP_BYTES);
+    raid_data.bitmap_dirty = 0;
+    memset(&raid_data.stats, 0, sizeof(raid_data.stats));
+    raid_data.booted = 1;
+    for(int i = 1; i <= RAID_DISK_NUMBER; i++){
+        raid_data.failed[i] = 0;
+        raid_data.dev[i] = i;
+    }
+    raid_data.spares = 0;
+    acquire(&raid_data.daemon_lock);
+    raid_data.rebuild_disk = 0;
+    raid_data.rebuild_cursor = 0;
+    raid_data.rebuild_running = 0;
+    release(&raid_data.daemon_lock);
+    // a partial chunk at the end of the members is left unused.
+    raid_data.numberOfBlocks = stripe_width(&raid_data.geom) * (RAID_DISK_ROWS / raid_data.geom.chunk * raid_data.geom.chunk);
     char name[] = "lock0";
     for(int i = 1; i <= RAID_DISK_NUMBER; i++){
         name[4] = '0' + i;
@@ -100,350 +771,1353 @@ int sys_init_raid_impl(enum RAID_TYPE raid){
         raid_data.locks[i].writers = 0;
         raid_data.locks[i].readers = 0;
     }
+    initlock(&raid_data.array_lock.lock, "array_lock");
+    raid_data.array_lock.writers = 0;
+    raid_data.array_lock.readers = 0;
+    for(int i = 0; i < RAID_STRIPE_CACHE; i++){
+        initlock(&raid_data.cache[i].lock.lock, "stripe_lock");
+        raid_data.cache[i].lock.writers = 0;
+        raid_data.cache[i].lock.readers = 0;
+    }
+    cache_reset();
+}
+
+// Create an array of the given level over the first ndisks disks,
+// striped in chunks of chunk blocks, with the next nspares disks as hot
+// spares; chunk <= 0 means one block and ndisks <= 0 all the disks found
+// at boot but the spares. The rest can join it later, see
+// sys_reshape_raid_impl(). Every member and spare is used up to the size
+// of the smallest.
+int sys_init_raid_impl(enum RAID_TYPE raid, int chunk, int ndisks, int nspares){
+    uint64 blocks = RAID_MEMBER_MAX;
+    if(chunk <= 0) chunk = 1;
+    if(nspares < 0) nspares = 0;
+    if(ndisks <= 0) ndisks = virtio_raid_disks() - nspares;
+    if(raid_data.booted || raid > RAID6 || ndisks + nspares > virtio_raid_disks()) return -1;
+    if((raid == RAID6 && ndisks < 4) || (raid != RAID0 && ndisks < 2) || ndisks < 1) return -1;
+    if(raid == RAID0 && nspares > 0) return -1; // nothing to rebuild a spare from
+    for(int i = 1; i <= ndisks + nspares; i++){
+        if(virtio_disk_blocks(i) < blocks) blocks = virtio_disk_blocks(i);
+    }
+    if(blocks <= RAID_SB_BLOCKS || chunk > blocks - RAID_SB_BLOCKS) return -1;
+    raid_setup(raid, chunk, ndisks, blocks);
+    for(int i = ndisks + 1; i <= ndisks + nspares; i++)
+        raid_data.spares |= 1 << i;
+    raid_data.uuid = new_uuid();
+    raid_data.events = 0;
+    raid_data.bitmap_events = 1; // the update below
+    raid_lock_write_acquire(&raid_data.array_lock);
+    sb_write_all();
+    raid_lock_write_release(&raid_data.array_lock);
     return 0;
 }
 
-int sys_read_raid_impl(int blkn, uchar* data){
-    if(!raid_data.booted || blkn >= raid_data.numberOfBlocks) return -1;
-    int diskNum, blkNum;
-    switch(raid_data.type){
-        case RAID0:
+// Put back the row a reshape was moving when the system went down from
+// the backup blocks, which hold all of it in the new layout.
+static void reshape_restore(void){
+    uchar* blks[RAID_DISK_NUMBER];
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    int member[RAID_DISK_NUMBER];
+    int n = 0;
 
-            diskNum = (blkn % RAID_DISK_NUMBER) + 1;
-            blkNum = blkn / RAID_DISK_NUMBER;
-            raid_lock_read_acquire(&raid_data.locks[diskNum]);
-            if(raid_data.failed[diskNum]) {
-                raid_lock_read_release(&raid_data.locks[diskNum]);
-                return -1;
-            }
-            raid_lock_read_release(&raid_data.locks[diskNum]);
-            read_block(diskNum, blkNum, data);
+    if(scratch_get(blks, RAID_DISK_NUMBER) < 0) return;
+    for(int i = 1; i <= raid_data.geom.ndisks; i++){
+        if(raid_data.failed[i]) continue;
+        member[n] = i;
+        reqs[n].diskn = raid_data.dev[i];
+        reqs[n].blockno = RAID_BACKUP_BLOCK;
+        reqs[n].data = blks[n];
+        reqs[n].write = 0;
+        n++;
+    }
+    raid_rw(reqs, n);
+    for(int i = 0; i < n; i++)
+        set_req(&reqs[i], member[i], raid_data.reshape_row - 1, blks[i], 1);
+    raid_rw(reqs, n);
+    raid_data.reshape_backup = 0;
+    scratch_put(blks, RAID_DISK_NUMBER);
+}
+
+// Assemble the array recorded in the members' superblocks, if any, so
+// that it comes back after a reboot as it was: same level, the same
+// members failed, and a rebuild or reshape that was under way resuming
+// from its last checkpoint. A member whose superblock is missing or
+// older than the newest one missed updates and counts as failed, unless
+// it is just one update behind: every update goes to all the members
+// that are up, so that one only missed the update the system went down
+// in. Regions the bitmap holds dirty were being written when the system
+// went down, so their members are brought back in step. The spares that
+// are still there stand by again, and one takes the place of a failed
+// member if no rebuild is under way. Called once at boot from the first
+// process, since it sleeps for disk I/O.
+void raid_assemble(void){
+    uchar* blks[RAID_DISK_NUMBER];
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    struct raid_super* sbs[RAID_DISK_NUMBER + 1];
+    struct raid_super* sb = 0;
+
+    if(scratch_get(blks, RAID_DISK_NUMBER) < 0) return;
+    // a member that was not found at boot reads as blank.
+    for(int i = 1; i <= RAID_DISK_NUMBER; i++){
+        reqs[i - 1].diskn = i;
+        reqs[i - 1].blockno = 0;
+        reqs[i - 1].data = blks[i - 1];
+        reqs[i - 1].write = 0;
+        sbs[i] = (struct raid_super*) blks[i - 1];
+        memset(sbs[i], 0, BSIZE);
+    }
+    raid_rw(reqs, virtio_raid_disks());
+    for(int i = 1; i <= RAID_DISK_NUMBER; i++){
+        if(sb_valid(sbs[i], i) && (sb == 0 || sbs[i]->events > sb->events))
+            sb = sbs[i];
+    }
+    if(sb == 0){
+        scratch_put(blks, RAID_DISK_NUMBER);
+        return;
+    }
+
+    raid_setup(sb->level, sb->chunk, sb->ndisks, sb->disk_blocks);
+    if(sb->reshaping){
+        raid_data.old.type = sb->old_level;
+        raid_data.old.ndisks = sb->old_ndisks;
+        raid_data.reshaping = 1;
+        raid_data.reshape_row = sb->reshape_row;
+        raid_data.reshape_backup = sb->reshape_backup;
+        raid_data.numberOfBlocks = stripe_width(&raid_data.old) * RAID_DISK_ROWS;
+    }
+    raid_data.uuid = sb->uuid;
+    raid_data.events = sb->events;
+    raid_data.bitmap_events = sb->bitmap_events;
+    memmove(raid_data.bitmap, sb->bitmap, RAID_BITMAP_BYTES);
+    memmove(raid_data.bitmap_next, sb->bitmap, RAID_BITMAP_BYTES);
+    for(int i = 0; i < RAID_BITMAP_BYTES; i++){
+        if(sb->bitmap[i]) raid_data.bitmap_dirty = 1;
+    }
+    raid_data.bitmap_ticks = ticks;
+    int nfailed = 0;
+    for(int i = 1; i <= raid_data.geom.ndisks; i++){
+        int d = sb->dev[i];
+        if(d < VIRTIO_RAID_DISK_START || d > RAID_DISK_NUMBER) d = i;
+        raid_data.dev[i] = d;
+        int current = sb_valid(sbs[d], d) && sbs[d]->index == i && sbs[d]->uuid == sb->uuid &&
+                      sbs[d]->events + 1 >= sb->events;
+        raid_data.failed[i] = !current || (sb->failed & (1 << i)) != 0;
+        nfailed += raid_data.failed[i];
+    }
+    for(int d = 1; d <= RAID_DISK_NUMBER; d++){
+        if((sb->spares & (1 << d)) && virtio_disk_blocks(d) >= raid_data.disk_blocks)
+            raid_data.spares |= 1 << d;
+    }
+    int rd = sb->rebuild_disk;
+    acquire(&raid_data.daemon_lock);
+    if(rd >= VIRTIO_RAID_DISK_START && rd <= raid_data.geom.ndisks && sb->rebuild_cursor <= RAID_DISK_ROWS &&
+       sbs[raid_data.dev[rd]]->uuid == sb->uuid && sbs[raid_data.dev[rd]]->events + 1 >= sb->events){
+        raid_data.rebuild_disk = rd;
+        raid_data.rebuild_cursor = sb->rebuild_cursor;
+        raid_data.rebuild_partial = sb->rebuild_partial;
+        raid_data.rebuild_running = 1;
+    }else if(raid_data.bitmap_dirty && nfailed == 0 && raid_data.geom.type != RAID0){
+        raid_data.resync_running = 1;
+    }else{
+        spare_takeover();
+    }
+    raid_data.reshape_running = raid_data.reshaping && nfailed == 0;
+    wakeup(&raid_data.rebuild_running);
+    release(&raid_data.daemon_lock);
+    scratch_put(blks, RAID_DISK_NUMBER);
+    printf("raid: assembled level %d array, %d of %d members failed%s%s\n", raid_data.geom.type, nfailed,
+           raid_data.geom.ndisks, raid_data.resync_running ? ", resyncing" : "",
+           raid_data.reshaping ? ", reshaping" : "");
+
+    // members found out of date learn it from their own superblock.
+    raid_lock_write_acquire(&raid_data.array_lock);
+    if(raid_data.reshape_backup) reshape_restore();
+    sb_write_all();
+    raid_lock_write_release(&raid_data.array_lock);
+}
+
+// Logical blocks are laid out chunk blocks at a time across the disks
+// a stripe holds data on, width of them: chunk 0 of the stripe on the
+// first, chunk 1 on the next, and so on, a stripe covering chunk rows.
+
+// The row, the block number on its member disks, of logical block blkn.
+static int row_of(int blkn){
+    struct raid_geom* g = blk_geom(blkn);
+    int c = blkn / g->chunk;
+    return c / stripe_width(g) * g->chunk + blkn % g->chunk;
+}
+
+// Which of the stripe's width chunks logical block blkn is in.
+static int slot_of(int blkn){
+    struct raid_geom* g = blk_geom(blkn);
+    return blkn / g->chunk % stripe_width(g);
+}
+
+// The rows from *lo to *hi cover the writes to blocks blkn .. blkn +
+// count - 1. Within a chunk they are the rows of its blocks; a range
+// spanning chunks touches whole chunk rows of its stripes.
+static void rows_of(int blkn, int count, int* lo, int* hi){
+    int c = blk_geom(blkn)->chunk;
+    *lo = row_of(blkn);
+    *hi = row_of(blkn + count - 1);
+    if(blkn / c != (blkn + count - 1) / c){
+        *lo -= *lo % c;
+        *hi += c - 1 - *hi % c;
+    }
+}
+
+// Pick which of the mirrors disks[0 .. n) holding row serves a read of
+// it. A mirror that just read the row before keeps a sequential run
+// going for RAID_READ_RUN rows, so a long read is cut into pieces that
+// the mirrors serve side by side. Otherwise the least busy mirror wins,
+// counting the requests this batch has queued on each, then the one that
+// last read nearest to row, then the next in turn.
+static int balance_read(int* disks, int n, int row, int* queued){
+    int best = -1, bestload = 0, bestdist = 0;
+    uint start = raid_data.next_mirror++;
+
+    for(int j = 0; j < n; j++){
+        int d = disks[(start + j) % n];
+        if(raid_data.last_row[d] + 1 == row && raid_data.run[d] < RAID_READ_RUN){
+            best = d;
             break;
+        }
+        int load = raid_data.reads_inflight[d] + queued[d];
+        int dist = raid_data.last_row[d] > row ? raid_data.last_row[d] - row : row - raid_data.last_row[d];
+        if(best < 0 || load < bestload || (load == bestload && dist < bestdist)){
+            best = d;
+            bestload = load;
+            bestdist = dist;
+        }
+    }
+    if(best < 0) return -1;
+    raid_data.run[best] = raid_data.last_row[best] + 1 == row ? raid_data.run[best] + 1 : 1;
+    raid_data.last_row[best] = row;
+    queued[best]++;
+    return best;
+}
+
+// Where a read of logical block blkn is served from: sets *blkNum and
+// returns the member disk, 0 if the block has to be reconstructed from
+// the rest of its stripe, or -1 if it is lost. queued counts the reads
+// already headed for each disk, for balance_read().
+static int read_target(int blkn, int* blkNum, int* queued){
+    struct raid_geom* g = blk_geom(blkn);
+    int diskNum, n = 0;
+    int disks[RAID_DISK_NUMBER];
+    switch(g->type){
+        case RAID0:
+            diskNum = slot_of(blkn) + 1;
+            *blkNum = row_of(blkn);
+            return raid_data.failed[diskNum] ? -1 : diskNum;
         case RAID1:
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_read_acquire(&raid_data.locks[i]);
+            *blkNum = blkn;
+            for(int i = 1; i <= g->ndisks; i++){
+                if(disk_ok(i, blkn)) disks[n++] = i;
             }
-            int i = 1;
-            for(; i <= VIRTIO_RAID_DISK_END; i++){
-                if(!raid_data.failed[i]) break;
-            }
-            if(i == RAID_DISK_NUMBER) {
-                for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                    raid_lock_read_release(&raid_data.locks[i]);
-                }
-                return -1;
-            }
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_read_release(&raid_data.locks[i]);
-            }
-            read_block(i, blkn, data);
-            break;
+            return balance_read(disks, n, blkn, queued);
         case RAID0_1:
-            diskNum = (blkn % (RAID_DISK_NUMBER / 2)) + 1;
-            blkNum = blkn / (RAID_DISK_NUMBER / 2);
-            if(raid_data.failed[diskNum]){
-                diskNum = diskNum + RAID_DISK_NUMBER / 2;
-                if(raid_data.failed[diskNum]){
-                    return -1;
-                }
-            }
-            raid_lock_read_acquire(&raid_data.locks[diskNum]);
-            read_block(diskNum, blkNum, data);
-            raid_lock_read_release(&raid_data.locks[diskNum]);
-            break;
+            diskNum = slot_of(blkn) + 1;
+            *blkNum = row_of(blkn);
+            if(disk_ok(diskNum, *blkNum)) disks[n++] = diskNum;
+            diskNum = diskNum + g->ndisks / 2;
+            if(disk_ok(diskNum, *blkNum)) disks[n++] = diskNum;
+            return balance_read(disks, n, *blkNum, queued);
         case RAID4:
-            diskNum = (blkn % (RAID_DISK_NUMBER - 1)) + 1;
-            blkNum = blkn / (RAID_DISK_NUMBER - 1);
-            if(raid_data.failed[diskNum]){
-                memset(data, 0, BSIZE);
-                for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                    raid_lock_read_acquire(&raid_data.locks[i]);
-                }
-                for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                    if(diskNum == i) continue;
-                    if(raid_data.failed[i]){
-                        for(int j = 1; j < RAID_DISK_NUMBER + 1; j++){
-                            raid_lock_read_release(&raid_data.locks[j]);
-                        }
-                        return -1;
-                    }
-                    uchar temporary_buffer[BSIZE];
-                    read_block(i, blkNum, temporary_buffer);
-                    for(int j = 0; j < BSIZE; j++){
-                        data[j] = data[j] ^ temporary_buffer[j];
-                    }
-                }
-                for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                    raid_lock_read_release(&raid_data.locks[i]);
-                }
-                break;
-            }
-            raid_lock_read_acquire(&raid_data.locks[diskNum]);
-            read_block(diskNum, blkNum, data);
-            raid_lock_read_release(&raid_data.locks[diskNum]);
-            break;
         case RAID5:
-
-            diskNum = (blkn + blkn / RAID_DISK_NUMBER + 1) % (RAID_DISK_NUMBER) + 1;
-            blkNum = blkn / (RAID_DISK_NUMBER - 1);
-            if(raid_data.failed[diskNum]){
-                memset(data, 0, BSIZE);
-                for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                    raid_lock_read_acquire(&raid_data.locks[i]);
-                }
-                for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                    if(diskNum == i) continue;
-                    if(raid_data.failed[i]){
-                        for(int j = 1; j < RAID_DISK_NUMBER + 1; j++){
-                            raid_lock_read_release(&raid_data.locks[j]);
-                        }
-                        return -1;
-                    }
-                    uchar temporary_buffer[BSIZE];
-                    read_block(i, blkNum, temporary_buffer);
-                    for(int j = 0; j < BSIZE; j++){
-                        data[j] = data[j] ^ temporary_buffer[j];
-                    }
-                }
-                for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                    raid_lock_read_release(&raid_data.locks[i]);
-                }
-                break;
-            }
-            raid_lock_read_acquire(&raid_data.locks[diskNum]);
-            read_block(diskNum, blkNum, data);
-            raid_lock_read_release(&raid_data.locks[diskNum]);
-            break;
+        case RAID6:
+            *blkNum = row_of(blkn);
+            diskNum = data_disk_of(*blkNum, slot_of(blkn));
+            return disk_ok(diskNum, *blkNum) ? diskNum : 0;
     }
-    return 0;
+    return -1;
 }
 
-int sys_write_raid_impl(int blkn, uchar* data){
-
-    if(!raid_data.booted || blkn >= raid_data.numberOfBlocks) return -1;
-    int diskNum, blkNum, parity_disk;
-    switch(raid_data.type){
+// The disks a write of logical block blkn goes to; returns how many.
+static int write_targets(int blkn, int* disks, int* blkNum){
+    struct raid_geom* g = blk_geom(blkn);
+    int n = 0;
+    switch(g->type){
         case RAID0:
-            diskNum = (blkn % RAID_DISK_NUMBER) + 1;
-            blkNum = blkn / RAID_DISK_NUMBER;
-            raid_lock_write_acquire(&raid_data.locks[diskNum]);
-            write_block(diskNum, blkNum, data);
-            raid_lock_write_release(&raid_data.locks[diskNum]);
+            disks[n++] = slot_of(blkn) + 1;
+            *blkNum = row_of(blkn);
             break;
         case RAID1:
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_write_acquire(&raid_data.locks[i]);
-            }
-            for(int i = VIRTIO_RAID_DISK_START; i <= VIRTIO_RAID_DISK_END; i++){
-                if(raid_data.failed[i]) {
-                    continue;
-                }
-
-                write_block(i, blkn, data);
-            }
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_write_release(&raid_data.locks[i]);
+            *blkNum = blkn;
+            for(int i = 1; i <= g->ndisks; i++){
+                if(disk_ok(i, blkn)) disks[n++] = i;
             }
             break;
         case RAID0_1:
-            int diskNum1 = (blkn % (RAID_DISK_NUMBER / 2)) + 1;
-            int diskNum2 = diskNum1 + RAID_DISK_NUMBER / 2;
-            int blkNum = blkn / (RAID_DISK_NUMBER / 2);
-            int count = 0;
-            if(!raid_data.failed[diskNum1]){
-                count = 1;
-                raid_lock_write_acquire(&raid_data.locks[diskNum1]);
-                write_block(diskNum1, blkNum, data);
-                raid_lock_write_release(&raid_data.locks[diskNum1]);
-            }
-            if(!raid_data.failed[diskNum2]){
-                raid_lock_write_acquire(&raid_data.locks[diskNum2]);
-                write_block(diskNum2, blkNum, data);
-                raid_lock_write_release(&raid_data.locks[diskNum2]);
-                count = 1;
-            }
-            if(count == 0) return -1;
+            *blkNum = row_of(blkn);
+            int diskNum = slot_of(blkn) + 1;
+            if(disk_ok(diskNum, *blkNum)) disks[n++] = diskNum;
+            diskNum = diskNum + g->ndisks / 2;
+            if(disk_ok(diskNum, *blkNum)) disks[n++] = diskNum;
             break;
-        case RAID4:
-            diskNum = blkn % (RAID_DISK_NUMBER - 1) + 1;
-            blkNum = blkn / (RAID_DISK_NUMBER - 1);
-            parity_disk = RAID_DISK_NUMBER;
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_write_acquire(&raid_data.locks[i]);
-            }
-            if(raid_data.failed[diskNum]) {
-                if(raid_data.failed[parity_disk]) {
-                    for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                        raid_lock_write_release(&raid_data.locks[i]);
-                    }
-                    return -1;
-                }
-                uchar temp_parity_buffer[BSIZE];
-                read_block(parity_disk, blkNum, temp_parity_buffer);
-                for (int j = 0; j < BSIZE; j++) {
-                    temp_parity_buffer[j] = temp_parity_buffer[j] ^ data[j];
-                }
-                write_block(parity_disk, blkNum, temp_parity_buffer);
-            }else{
-                uchar old_val[BSIZE];
-                write_block(diskNum, blkNum, data);
-                if(raid_data.failed[parity_disk]) {
-                    for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                        raid_lock_write_release(&raid_data.locks[i]);
-                    }
-                    return -1;
-                }
-                read_block(diskNum, blkNum, old_val);
-                read_block(parity_disk, blkNum, parity_buffer);
-                for (int j = 0; j < BSIZE; j++) {
-                    parity_buffer[j] = parity_buffer[j] ^ data[j] ^ old_val[j];
-                }
-                write_block(parity_disk, blkNum, parity_buffer);
-            }
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_write_release(&raid_data.locks[i]);
-            }
+        default:
             break;
+    }
+    return n;
+}
+
+// The member disks logical block blkn of a striped or mirrored level
+// is read from and written to, as lock_batch() mask bits.
+static uint64 block_disks(int blkn){
+    struct raid_geom* g = blk_geom(blkn);
+    int d = slot_of(blkn) + 1;
+    uint64 mask = 0;
+    switch(g->type){
+        case RAID0:
+            return RAID_BATCH_DISK(d);
+        case RAID1:
+            for(int i = 1; i <= g->ndisks; i++) mask |= RAID_BATCH_DISK(i);
+            return mask;
+        case RAID0_1:
+            return RAID_BATCH_DISK(d) | RAID_BATCH_DISK(d + g->ndisks / 2);
+        default:
+            return 0;
+    }
+}
+
+// Lock what a batch of blocks blkn .. blkn + n - 1 needs: the array
+// lock, the stripe locks (in table order) of the blocks on a parity
+// level, then the disks the others map to, in increasing order. While
+// a reshape changes the level a batch may straddle both layouts, so
+// then it takes every member disk.
+static uint64 lock_batch(int blkn, int n, int write){
+    uint64 mask = 0;
+    raid_lock_read_acquire(&raid_data.array_lock);
+    for(int b = blkn; b < blkn + n; b++){
+        if(parity_level(blk_geom(b))) mask |= 1L << (row_of(b) % RAID_STRIPE_CACHE);
+        else if(raid_data.reshaping){
+            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++) mask |= RAID_BATCH_DISK(i);
+        }else mask |= block_disks(b);
+    }
+    for(int i = 0; i < RAID_STRIPE_CACHE; i++){
+        if(mask & (1L << i)) raid_lock_read_acquire(&raid_data.cache[i].lock);
+    }
+    for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
+        if(!(mask & RAID_BATCH_DISK(i))) continue;
+        if(write) raid_lock_write_acquire(&raid_data.locks[i]);
+        else raid_lock_read_acquire(&raid_data.locks[i]);
+    }
+    return mask;
+}
+
+static void unlock_batch(uint64 mask, int write){
+    for(int i = 0; i < RAID_STRIPE_CACHE; i++){
+        if(mask & (1L << i)) raid_lock_read_release(&raid_data.cache[i].lock);
+    }
+    for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
+        if(!(mask & RAID_BATCH_DISK(i))) continue;
+        if(write) raid_lock_write_release(&raid_data.locks[i]);
+        else raid_lock_read_release(&raid_data.locks[i]);
+    }
+    raid_lock_read_release(&raid_data.array_lock);
+}
+
+// Copy logical block blkn into out if the stripe cache holds it. The caller
+// holds its row's stripe lock.
+static int cache_read(int blkn, uchar* out){
+    int row = row_of(blkn), s = slot_of(blkn);
+    struct stripe_head* sh = cache_of(row);
+    if(sh->row != row || !(sh->valid & (1 << s))) return 0;
+    memmove(out, sh->blocks[s], BSIZE);
+    return 1;
+}
+
+// Read logical block blkn of a parity level, whose disk has failed, by
+// reconstructing its whole row into the stripe cache. Later reads of
+// the row are served from there without touching the disks, and
+// writes to it keep the cached blocks current.
+static int read_degraded(int blkn, uchar* out){
+    int row, ret = 0;
+    uint64 start = mtime();
+
+    // where blkn is may have changed since the batch let go, by a reshape.
+    raid_lock_read_acquire(&raid_data.array_lock);
+    row = row_of(blkn);
+    raid_lock_write_acquire(stripe_lock(row));
+    struct stripe_head* sh = cache_get(row);
+    if(cache_fill(sh, (1 << row_geom(row)->ndisks) - 1) < 0)
+        ret = -1;
+    else
+        memmove(out, sh->blocks[slot_of(blkn)], BSIZE);
+    raid_lock_write_release(stripe_lock(row));
+    raid_lock_read_release(&raid_data.array_lock);
+    stat_time(RAID_STAT_RECONSTRUCT, start);
+    return ret;
+}
+
+// What read_batch() and write_batch() keep of a batch, in a kalloc()ed
+// page rather than on the kernel stack.
+struct raid_batch{
+    struct disk_req reqs[RAID_BATCH];
+    int blkNum[RAID_BATCH];
+    int target[RAID_BATCH]; // read_target()'s disk for each block
+    int member[RAID_BATCH]; // and each request's
+};
+_Static_assert(sizeof(struct raid_batch) <= PGSIZE, "struct raid_batch must fit in a page");
+
+// Read blocks blkn .. blkn + n - 1, n <= RAID_BATCH. Blocks the stripe
+// cache holds come from there. Every other block that can be read
+// directly is in flight at once, spread over the members; the ones on a
+// failed disk are then reconstructed, once the batch's locks are let go
+// for the stripe lock of each row rebuilt.
+static int read_batch(int blkn, int n, uchar** data){
+    struct raid_batch* bt;
+    int queued[RAID_DISK_NUMBER + 1];
+    int nreq = 0, ret = 0;
+    uint cached = 0;
+
+    if((bt = kalloc()) == 0) return -1;
+    struct disk_req* reqs = bt->reqs;
+    int *blkNum = bt->blkNum, *target = bt->target, *member = bt->member;
+    memset(queued, 0, sizeof(queued));
+    uint64 mask = lock_batch(blkn, n, 0);
+    for(int i = 0; i < n; i++){
+        if(parity_level(blk_geom(blkn + i)) && cache_read(blkn + i, data[i])){
+            cached |= 1u << i;
+            __sync_fetch_and_add(&raid_data.stats.cache_hits, 1);
+            continue;
+        }
+        target[i] = read_target(blkn + i, &blkNum[i], queued);
+        if(target[i] < 0) ret = -1;
+        if(target[i] == 0) __sync_fetch_and_add(&raid_data.stats.degraded_reads, 1);
+        if(target[i] > 0){
+            member[nreq] = target[i];
+            set_req(&reqs[nreq++], target[i], blkNum[i], data[i], 0);
+        }
+    }
+    if(ret == 0){
+        for(int i = 0; i < nreq; i++)
+            __sync_fetch_and_add(&raid_data.reads_inflight[member[i]], 1);
+        raid_rw(reqs, nreq);
+        for(int i = 0; i < nreq; i++)
+            __sync_fetch_and_sub(&raid_data.reads_inflight[member[i]], 1);
+    }
+    unlock_batch(mask, 0);
+    for(int i = 0; i < n && ret == 0; i++){
+        if(!(cached & (1u << i)) && target[i] == 0)
+            ret = read_degraded(blkn + i, data[i]);
+    }
+    kfree(bt);
+    return ret;
+}
+
+// Read count consecutive blocks starting at blkn into data[0 .. count).
+int raid_read_blocks(int blkn, int count, uchar** data){
+    if(!raid_data.booted || blkn < 0 || count <= 0 || blkn + count > raid_data.numberOfBlocks) return -1;
+    uint64 start = mtime();
+    int ret = 0;
+    for(int b = blkn; b < blkn + count && ret == 0; b += RAID_BATCH){
+        int n = blkn + count - b < RAID_BATCH ? blkn + count - b : RAID_BATCH;
+        ret = read_batch(b, n, data + (b - blkn));
+    }
+    stat_time(RAID_STAT_READ, start);
+    return ret;
+}
+
+int sys_read_raid_impl(int blkn, uchar* data){
+    return raid_read_blocks(blkn, 1, &data);
+}
+
+// Write blocks blkn .. blkn + n - 1 of a striped or mirrored array, all
+// copies of all of them in flight together, up to RAID_BATCH requests
+// at a time.
+static int write_batch(int blkn, int n, uchar** data){
+    struct raid_batch* bt;
+    int disks[RAID_DISK_NUMBER];
+    int nreq = 0, ret = 0;
+
+    if((bt = kalloc()) == 0) return -1;
+    struct disk_req* reqs = bt->reqs;
+    uint64 mask = lock_batch(blkn, n, 1);
+    for(int i = 0; i < n; i++){
+        int blkNum;
+        int m = write_targets(blkn + i, disks, &blkNum);
+        if(m == 0) ret = -1;
+        if(nreq + m > RAID_BATCH){
+            raid_rw(reqs, nreq);
+            nreq = 0;
+        }
+        for(int j = 0; j < m; j++)
+            set_req(&reqs[nreq++], disks[j], blkNum, data[i], 1);
+    }
+    raid_rw(reqs, nreq);
+    unlock_batch(mask, 1);
+    kfree(bt);
+    return ret;
+}
+
+// Write count consecutive blocks starting at blkn, all laid out alike,
+// data[i] going to block blkn + i. On the parity levels the range is cut
+// into rows, so each row gets a single parity update and fully covered
+// rows skip the read-modify-write entirely. The caller holds array_lock
+// shared.
+static int write_range(int blkn, int count, uchar** data){
+    struct raid_geom* g = blk_geom(blkn);
+    int k = data_disks(g), c = g->chunk, ret = 0;
+    int lo, hi;
+    rows_of(blkn, count, &lo, &hi);
+    bitmap_mark(lo, hi);
+    switch(g->type){
+        case RAID4:
         case RAID5:
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_write_acquire(&raid_data.locks[i]);
-            }
-            diskNum = (blkn + blkn / RAID_DISK_NUMBER + 1) % (RAID_DISK_NUMBER) + 1;
-            blkNum = blkn / (RAID_DISK_NUMBER - 1);
-            parity_disk = (blkNum % RAID_DISK_NUMBER) + 1;
-            if(raid_data.failed[diskNum]) {
-                uchar temp_parity_buffer[BSIZE];
-                read_block(parity_disk, blkNum, temp_parity_buffer);
-                for (int j = 0; j < BSIZE; j++) {
-                    temp_parity_buffer[j] = temp_parity_buffer[j] ^ data[j];
+        case RAID6:
+            // row s * c + o of stripe s holds block s * k * c + j * c + o
+            // of each chunk j; write the chunks j0 .. j1 the range covers.
+            for(int s = blkn / (k * c); s <= (blkn + count - 1) / (k * c) && ret == 0; s++){
+                for(int o = 0; o < c && ret == 0; o++){
+                    uchar* ptrs[RAID_DISK_NUMBER];
+                    int base = s * k * c + o;
+                    int j0 = blkn <= base ? 0 : (blkn - base + c - 1) / c;
+                    int j1 = blkn + count - 1 - base;
+                    if(j1 < 0) continue;
+                    j1 = j1 / c < k - 1 ? j1 / c : k - 1;
+                    if(j0 > j1) continue;
+                    for(int j = j0; j <= j1; j++)
+                        ptrs[j - j0] = data[base + j * c - blkn];
+                    raid_lock_write_acquire(stripe_lock(s * c + o));
+                    ret = write_stripe(s * c + o, j0, j1 - j0 + 1, ptrs);
+                    raid_lock_write_release(stripe_lock(s * c + o));
                 }
-                write_block(parity_disk, blkNum, temp_parity_buffer);
-            }else{
-                uchar old_val[BSIZE];
-                read_block(diskNum, blkNum, old_val);
-                write_block(diskNum, blkNum, data);
-                read_block(parity_disk, blkNum, parity_buffer);
-                for (int j = 0; j < BSIZE; j++) {
-                    parity_buffer[j] = parity_buffer[j] ^ data[j] ^ old_val[j];
-                }
-                write_block(parity_disk, blkNum, parity_buffer);
             }
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_write_release(&raid_data.locks[i]);
+            break;
+        default:
+            for(int b = blkn; b < blkn + count && ret == 0; b += RAID_BATCH){
+                int n = blkn + count - b < RAID_BATCH ? blkn + count - b : RAID_BATCH;
+                ret = write_batch(b, n, data + (b - blkn));
             }
             break;
     }
-    return 0;
+    return ret;
+}
+
+// Write count consecutive blocks starting at blkn, data[i] going to
+// block blkn + i, split where a reshape under way has got to.
+int raid_write_blocks(int blkn, int count, uchar** data){
+    if(!raid_data.booted || blkn < 0 || count <= 0 || blkn + count > raid_data.numberOfBlocks) return -1;
+    uint64 start = mtime();
+    int ret = 0;
+    raid_lock_read_acquire(&raid_data.array_lock);
+    int moved = raid_data.reshape_row * stripe_width(&raid_data.geom);
+    for(int b = blkn, end; b < blkn + count && ret == 0; b = end){
+        end = blkn + count;
+        if(raid_data.reshaping && b < moved && end > moved) end = moved;
+        ret = write_range(b, end - b, data + (b - blkn));
+    }
+    raid_lock_read_release(&raid_data.array_lock);
+    stat_time(RAID_STAT_WRITE, start);
+    return ret;
+}
+
+int sys_write_raid_impl(int blkn, uchar* data){
+    return raid_write_blocks(blkn, 1, &data);
 }
 
 int sys_disk_fail_raid_impl(int diskn){
-    if(!raid_data.booted || diskn > VIRTIO_RAID_DISK_END || diskn < VIRTIO_RAID_DISK_START || raid_data.failed[diskn]) return -1;
+    if(!raid_data.booted) return -1;
+    // member state only changes under array_lock held for writing.
+    raid_lock_write_acquire(&raid_data.array_lock);
+    if(diskn > raid_data.geom.ndisks || diskn < VIRTIO_RAID_DISK_START ||
+       (raid_data.failed[diskn] && diskn != raid_data.rebuild_disk)){
+        raid_lock_write_release(&raid_data.array_lock);
+        return -1;
+    }
     raid_data.failed[diskn] = 1;
+    // a disk that fails again while it is rebuilt starts over.
+    acquire(&raid_data.daemon_lock);
+    raid_data.resync_running = 0;
+    raid_data.scrub_running = 0;
+    raid_data.reshape_running = 0; // until the array is whole again
+    if(diskn == raid_data.rebuild_disk){
+        raid_data.rebuild_disk = 0;
+        raid_data.rebuild_cursor = 0;
+        raid_data.rebuild_running = 0;
+    }
+    spare_takeover();
+    release(&raid_data.daemon_lock);
+    sb_write_all();
+    raid_lock_write_release(&raid_data.array_lock);
     return 0;
 }
 
+// Was diskn in step with the rest of the array when the bitmap was last
+// clean? Then it only misses the writes the bitmap has recorded since,
+// and only the dirty regions need rebuilding. A blank disk, or one that
+// failed in the middle of a rebuild, has to be rebuilt in full.
+static int member_in_sync(int diskn){
+    uchar* blk[1];
+    struct disk_req req;
+
+    if(scratch_get(blk, 1) < 0) return 0;
+    req.diskn = raid_data.dev[diskn];
+    req.blockno = 0;
+    req.data = blk[0];
+    req.write = 0;
+    raid_rw(&req, 1);
+    struct raid_super* sb = (struct raid_super*) blk[0];
+    int ok = sb_valid(sb, raid_data.dev[diskn]) && sb->index == diskn && sb->uuid == raid_data.uuid &&
+             sb->events >= raid_data.bitmap_events && sb->rebuild_disk != diskn;
+    scratch_put(blk, 1);
+    return ok;
+}
+
+// Hand a replaced disk to raidd and return; the disk keeps counting as
+// failed until all of it has been rebuilt. A rebuild that was paused
+// resumes where it stopped, and a disk that comes back with its data
+// only gets the regions written while it was away.
 int sys_disk_repaired_raid_impl(int diskn){
-    if(!raid_data.booted || diskn > VIRTIO_RAID_DISK_END || diskn < VIRTIO_RAID_DISK_START || !raid_data.failed[diskn]) return -1;
-    raid_data.failed[diskn] = 0;
-    switch(raid_data.type){
-        case RAID0:
-            return -1;
-        case RAID1:
-            int i = 1;
-            for(;i <= RAID_DISK_NUMBER; i++){
-                if(i != diskn && !raid_data.failed[i])
-                    break;
-            }
-            if(i == RAID_DISK_NUMBER) return -1;
+    if(!raid_data.booted) return -1;
+    int ret = 0;
+    raid_lock_write_acquire(&raid_data.array_lock);
+    if(diskn > raid_data.geom.ndisks || diskn < VIRTIO_RAID_DISK_START || !raid_data.failed[diskn] ||
+       virtio_disk_blocks(raid_data.dev[diskn]) < raid_data.disk_blocks){ // too small a replacement
+        raid_lock_write_release(&raid_data.array_lock);
+        return -1;
+    }
+    if(raid_data.geom.type == RAID0 || raid_data.old.type == RAID0){
+        // nothing to rebuild it from: the disk comes back as it is.
+        raid_data.failed[diskn] = 0;
+        sb_write_all();
+        raid_lock_write_release(&raid_data.array_lock);
+        return 0;
+    }
+    int partial = raid_data.rebuild_disk != diskn && member_in_sync(diskn);
+    acquire(&raid_data.daemon_lock);
+    if(raid_data.rebuild_running){
+        ret = -1; // one rebuild at a time
+    }else{
+        if(raid_data.rebuild_disk != diskn){
+            raid_data.rebuild_disk = diskn;
+            raid_data.rebuild_cursor = 0;
+            raid_data.rebuild_partial = partial;
+        }
+        raid_data.rebuild_running = 1;
+        wakeup(&raid_data.rebuild_running);
+    }
+    release(&raid_data.daemon_lock);
+    if(ret == 0)
+        sb_write_all();
+    raid_lock_write_release(&raid_data.array_lock);
+    return ret;
+}
 
-            copy_disk_data(i, diskn);
+// Report the disk being rebuilt (0 if none) and how many of its rows
+// are done.
+int sys_rebuild_info_raid_impl(uint *diskn, uint *done, uint *total){
+    if(!raid_data.booted) return -1;
+    acquire(&raid_data.daemon_lock);
+    *diskn = raid_data.rebuild_disk;
+    *done = raid_data.rebuild_cursor;
+    *total = RAID_DISK_ROWS;
+    release(&raid_data.daemon_lock);
+    return 0;
+}
 
-            break;
+// Limit the rebuild to rows rows per clock tick, 0 for no limit.
+int sys_rebuild_rate_raid_impl(int rows){
+    if(rows < 0) return -1;
+    raid_data.rebuild_rate = rows;
+    return 0;
+}
+
+// Start a scrub of the whole array, which raidd runs behind any rebuild
+// or resync. With repair set mismatches are fixed, not only counted.
+int sys_scrub_raid_impl(int repair){
+    if(!raid_data.booted || raid_data.geom.type == RAID0) return -1;
+    int ret = 0;
+    acquire(&raid_data.daemon_lock);
+    if(raid_data.scrub_running || degraded()){
+        ret = -1;
+    }else{
+        raid_data.scrub_running = 1;
+        raid_data.scrub_repair = repair != 0;
+        raid_data.scrub_cursor = 0;
+        raid_data.scrub_checked = 0;
+        raid_data.scrub_mismatches = 0;
+        raid_data.scrub_repaired = 0;
+        wakeup(&raid_data.rebuild_running);
+    }
+    release(&raid_data.daemon_lock);
+    return ret;
+}
+
+// Report the counters of the running or last scrub: rows checked, rows
+// found mismatched and rows repaired. Returns 1 while a scrub runs.
+int sys_scrub_info_raid_impl(uint *checked, uint *mismatches, uint *repaired){
+    if(!raid_data.booted) return -1;
+    acquire(&raid_data.daemon_lock);
+    *checked = raid_data.scrub_checked;
+    *mismatches = raid_data.scrub_mismatches;
+    *repaired = raid_data.scrub_repaired;
+    int running = raid_data.scrub_running;
+    release(&raid_data.daemon_lock);
+    return running;
+}
+
+// Find disks for members geom.ndisks + 1 .. ndisks, taking those that
+// are neither members nor spares first, then spares. Returns -1, with
+// nothing changed, if there are not enough disks large enough.
+static int new_members(int ndisks){
+    int dev[RAID_DISK_NUMBER + 1];
+    uint taken = raid_data.spares, spares = raid_data.spares;
+
+    for(int i = 1; i <= raid_data.geom.ndisks; i++)
+        taken |= 1 << raid_data.dev[i];
+    for(int i = raid_data.geom.ndisks + 1; i <= ndisks; i++){
+        int d;
+        for(d = 1; d <= virtio_raid_disks(); d++){
+            if(!(taken & (1 << d)) && virtio_disk_blocks(d) >= raid_data.disk_blocks) break;
+        }
+        if(d > virtio_raid_disks()){
+            for(d = 1; d <= RAID_DISK_NUMBER && !(spares & (1 << d)); d++)
+                ;
+            if(d > RAID_DISK_NUMBER) return -1;
+            spares &= ~(1 << d);
+        }
+        taken |= 1 << d;
+        dev[i] = d;
+    }
+    for(int i = raid_data.geom.ndisks + 1; i <= ndisks; i++)
+        raid_data.dev[i] = dev[i];
+    raid_data.spares = spares;
+    return 0;
+}
+
+// Start reshaping the array to level raid over ndisks members, the new
+// ones on disks new_members() finds, which raidd carries out a row at a
+// time while the array stays in use; the new capacity is there once it
+// is done. The array can gain disks and change level, as from RAID1 or
+// RAID4 to RAID5, as long as a row of the new layout holds at least as
+// many blocks as one of the old, so that moving a row never overwrites
+// blocks not moved yet. Only arrays striped a block at a time can be
+// reshaped.
+int sys_reshape_raid_impl(enum RAID_TYPE raid, int ndisks){
+    struct raid_geom g = { raid, ndisks, 1 };
+    if(!raid_data.booted || raid > RAID6 || ndisks > virtio_raid_disks() || ndisks < raid_data.geom.ndisks) return -1;
+    if((raid == RAID6 && ndisks < 4) || raid_data.geom.chunk != 1) return -1;
+    if(stripe_width(&g) < stripe_width(&raid_data.geom)) return -1;
+    if(raid == raid_data.geom.type && ndisks == raid_data.geom.ndisks) return -1;
+    int ret = 0;
+    raid_lock_write_acquire(&raid_data.array_lock);
+    acquire(&raid_data.daemon_lock);
+    if(raid_data.reshaping || raid_data.rebuild_running || raid_data.resync_running || degraded() ||
+       new_members(ndisks) < 0){
+        ret = -1;
+    }else{
+        raid_data.old = raid_data.geom;
+        raid_data.geom = g;
+        for(int i = raid_data.old.ndisks + 1; i <= ndisks; i++)
+            raid_data.failed[i] = 0;
+        raid_data.reshaping = 1;
+        raid_data.reshape_running = 1;
+        raid_data.reshape_row = 0;
+        raid_data.reshape_backup = 0;
+        wakeup(&raid_data.rebuild_running);
+    }
+    release(&raid_data.daemon_lock);
+    if(ret == 0)
+        sb_write_all();
+    raid_lock_write_release(&raid_data.array_lock);
+    return ret;
+}
+
+// The mirror row rebuilt disk diskn copies from, or -1 if there is none.
+static int mirror_source(int diskn, int row){
+    struct raid_geom* g = row_geom(row);
+    switch(g->type){
+        case RAID1:
+            for(int i = 1; i <= g->ndisks; i++){
+                if(i != diskn && disk_ok(i, row)) return i;
+            }
+            return -1;
         case RAID0_1:
-            int first_second = diskn / (RAID_DISK_NUMBER / 2);
-            int disk_ind;
-            if(first_second == 0){
-                disk_ind = diskn + (RAID_DISK_NUMBER / 2);
+            if(diskn > g->ndisks / 2) diskn -= g->ndisks / 2;
+            else diskn += g->ndisks / 2;
+            return disk_ok(diskn, row) ? diskn : -1;
+        default:
+            return -1;
+    }
+}
+
+// Rebuild one row of disk diskn into blk and move the cursor past it,
+// under the same locks a write of that row takes. Returns 1 if the row
+// was skipped as clean, -1 if it cannot be recovered or the rebuild was
+// called off meanwhile.
+static int rebuild_row(int diskn, int row, uchar* blk){
+    int ret = -1;
+    uint64 start = mtime();
+    raid_lock_read_acquire(&raid_data.array_lock);
+    if(raid_data.rebuild_disk != diskn || !raid_data.rebuild_running){
+        raid_lock_read_release(&raid_data.array_lock);
+        return -1;
+    }
+    if(diskn > row_geom(row)->ndisks || (raid_data.rebuild_partial && !region_dirty(row))){
+        // the row, in a layout the disk joins by a reshape, has nothing
+        // on it, or nothing was written here while the disk was away.
+        struct raid_lock* l = parity_level(row_geom(row)) ?
+                              stripe_lock(row) : &raid_data.locks[diskn];
+        raid_lock_write_acquire(l);
+        raid_data.rebuild_cursor = row + 1;
+        raid_lock_write_release(l);
+        ret = 1;
+    }else if(parity_level(row_geom(row))){
+        raid_lock_write_acquire(stripe_lock(row));
+        if(recover_block(row, diskn, blk) == 0){
+            struct disk_req req;
+            set_req(&req, diskn, row, blk, 1);
+            raid_rw(&req, 1);
+            raid_data.rebuild_cursor = row + 1;
+            ret = 0;
+        }
+        raid_lock_write_release(stripe_lock(row));
+    }else{
+        int src = mirror_source(diskn, row);
+        if(src > 0){
+            // disk locks in increasing order, as lock_batch takes them.
+            struct raid_lock* l1 = &raid_data.locks[src < diskn ? src : diskn];
+            struct raid_lock* l2 = &raid_data.locks[src < diskn ? diskn : src];
+            if(src < diskn){
+                raid_lock_read_acquire(l1);
+                raid_lock_write_acquire(l2);
+            }else{
+                raid_lock_write_acquire(l1);
+                raid_lock_read_acquire(l2);
+            }
+            struct disk_req req;
+            set_req(&req, src, row, blk, 0);
+            raid_rw(&req, 1);
+            set_req(&req, diskn, row, blk, 1);
+            raid_rw(&req, 1);
+            raid_data.rebuild_cursor = row + 1;
+            if(src < diskn){
+                raid_lock_write_release(l2);
+                raid_lock_read_release(l1);
             }else{
-                disk_ind = diskn - (RAID_DISK_NUMBER / 2);
+                raid_lock_read_release(l2);
+                raid_lock_write_release(l1);
             }
-            if( raid_data.failed[disk_ind] ) return -1;
-            printf("\n%d %d\n", diskn, disk_ind);
-            copy_disk_data(disk_ind, diskn);
+            ret = 0;
+        }
+    }
+    raid_lock_read_release(&raid_data.array_lock);
+    if(ret == 0)
+        stat_time(RAID_STAT_REBUILD, start);
+    return ret;
+}
 
-            break;
+// Bring row row of a whole array back in step: the mirrors copy the
+// first of each set of copies, the parity is recomputed from the data.
+// Taken under the locks a write of the row takes.
+static int resync_row(int row, uchar* blk){
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    int n = 0, ret = 0;
+
+    raid_lock_read_acquire(&raid_data.array_lock);
+    if(!raid_data.resync_running || degraded()){
+        raid_lock_read_release(&raid_data.array_lock);
+        return -1;
+    }
+    struct raid_geom* g = row_geom(row);
+    switch(g->type){
+        case RAID0:
+            break; // a row a reshape has not moved off RAID0 yet
         case RAID4:
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
-                raid_lock_write_acquire(&raid_data.locks[i]);
+        case RAID5:
+            raid_lock_write_acquire(stripe_lock(row));
+            cache_drop(row); // its parity may have been read before the resync
+            ret = stripe_xor(row, parity_disk_of(row), 0, blk);
+            if(ret == 0){
+                set_req(&reqs[0], parity_disk_of(row), row, blk, 1);
+                raid_rw(reqs, 1);
             }
-            for (int i = 0; i < raid_data.numberOfBlocks; i += raid_data.numberOfBlocks / (RAID_DISK_NUMBER - 1)) {
-                read_block(RAID_DISK_NUMBER, i / (RAID_DISK_NUMBER - 1), parity_buffer);
-                uchar temp_parity_buffer[BSIZE];
-                for (int k = 0; k < BSIZE; k++) {
-                    temp_parity_buffer[k] = temp_parity_buffer[k] ^ parity_buffer[k];
-                }
-                for(int j = 0; j < raid_data.numberOfBlocks / RAID_DISK_NUMBER; j++){
-                    uchar data_buffer[BSIZE];
-                    disk_ind = (i + j) % (RAID_DISK_NUMBER - 1) + 1;
-                    if (disk_ind == diskn)
-                        continue;
-                    if(raid_data.failed[disk_ind]) {
-                        for(int k = 1; k < RAID_DISK_NUMBER + 1; k++){
-                            raid_lock_write_release(&raid_data.locks[k]);
-                        }
-                        return -1;
-                    }
-                    int blk_ind = (i + j) / (RAID_DISK_NUMBER - 1);
-                    read_block(disk_ind, blk_ind, data_buffer);
-                    for (int k = 0; k < BSIZE; k++) {
-                        temp_parity_buffer[k] = temp_parity_buffer[k] ^ data_buffer[k];
-                    }
-                }
-                write_block(diskn, i / RAID_DISK_NUMBER, temp_parity_buffer);
+            raid_lock_write_release(stripe_lock(row));
+            break;
+        case RAID6:
+            raid_lock_write_acquire(stripe_lock(row));
+            cache_drop(row);
+            int k = data_disks(g);
+            uchar* blks[RAID_DISK_NUMBER];
+            if(scratch_get(blks, k + 2) == 0){
+                for(int i = 0; i < k; i++)
+                    set_req(&reqs[n++], data_disk_of(row, i), row, blks[i], 0);
+                raid_rw(reqs, n);
+                gen_pq(blks[k], blks[k + 1], blks, k);
+                set_req(&reqs[0], parity_disk_of(row), row, blks[k], 1);
+                set_req(&reqs[1], q_disk_of(row), row, blks[k + 1], 1);
+                raid_rw(reqs, 2);
+                scratch_put(blks, k + 2);
+            }else{
+                ret = -1;
             }
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
+            raid_lock_write_release(stripe_lock(row));
+            break;
+        case RAID1:
+            for(int i = 1; i <= RAID_DISK_NUMBER; i++)
+                raid_lock_write_acquire(&raid_data.locks[i]);
+            set_req(&reqs[0], 1, row, blk, 0);
+            raid_rw(reqs, 1);
+            for(int i = 2; i <= g->ndisks; i++)
+                set_req(&reqs[n++], i, row, blk, 1);
+            raid_rw(reqs, n);
+            for(int i = 1; i <= RAID_DISK_NUMBER; i++)
                 raid_lock_write_release(&raid_data.locks[i]);
-            }
             break;
-        case RAID5:
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
+        default:
+            for(int i = 1; i <= RAID_DISK_NUMBER; i++)
                 raid_lock_write_acquire(&raid_data.locks[i]);
+            for(int i = 1; i <= g->ndisks / 2; i++){
+                set_req(&reqs[0], i, row, blk, 0);
+                raid_rw(reqs, 1);
+                set_req(&reqs[0], i + g->ndisks / 2, row, blk, 1);
+                raid_rw(reqs, 1);
             }
-            for(int i = 0; i < raid_data.numberOfBlocks / RAID_DISK_NUMBER + 1; i++) {
-                memset(parity_buffer, 0, BSIZE);
-                for (int j = 1; j < RAID_DISK_NUMBER + 1; j++) {
-                    if (diskn == j) continue;
-                    if(raid_data.failed[j]) {
-                        for(int k = 1; k < RAID_DISK_NUMBER + 1; k++){
-                            raid_lock_write_release(&raid_data.locks[k]);
-                        }
-                        return -1;
-                    }
-                    uchar temporary_buffer[BSIZE];
-                    read_block(j, i, temporary_buffer);
-                    for (int k = 0; k < BSIZE; k++) {
-                        parity_buffer[k] = parity_buffer[k] ^ temporary_buffer[k];
-                    }
-                }
-                write_block(diskn, i, parity_buffer);
-            }
-            for(int i = 1; i < RAID_DISK_NUMBER + 1; i++){
+            for(int i = 1; i <= RAID_DISK_NUMBER; i++)
                 raid_lock_write_release(&raid_data.locks[i]);
-            }
             break;
     }
+    raid_lock_read_release(&raid_data.array_lock);
+    return ret;
+}
+
+// Check that the copies of row agree, or that its parity matches its
+// data, and count a mismatch if not. Repairing, the copies are
+// rewritten from the first of them and the parity from the data, as a
+// resync would. Taken under the locks a write of the row takes, after
+// the stripe cache gives up the row so that the disks are current.
+static int scrub_row(int row){
+    struct disk_req reqs[RAID_DISK_NUMBER];
+    uchar* blks[RAID_DISK_NUMBER + 2];
+    struct raid_geom* g;
+    int n = 0, bad = 0;
+
+    raid_lock_read_acquire(&raid_data.array_lock);
+    if(!raid_data.scrub_running || degraded() || scratch_get(blks, RAID_DISK_NUMBER + 2) < 0){
+        raid_lock_read_release(&raid_data.array_lock);
+        return -1;
+    }
+    g = row_geom(row);
+    int nd = g->ndisks, k = data_disks(g);
+    if(parity_level(g)){
+        raid_lock_write_acquire(stripe_lock(row));
+        cache_drop(row);
+        for(int s = 0; s < nd; s++)
+            set_req(&reqs[s], slot_disk(row, s), row, blks[s], 0);
+        raid_rw(reqs, nd);
+        // the expected P and Q, into the two spare blocks.
+        uchar* q = g->type == RAID6 ? blks[nd + 1] : 0;
+        gen_pq(blks[nd], q, blks, k);
+        for(int s = k; s < nd; s++){
+            uchar* want = blks[nd + s - k];
+            if(memcmp(blks[s], want, BSIZE) == 0) continue;
+            bad = 1;
+            set_req(&reqs[n++], slot_disk(row, s), row, want, 1);
+        }
+    }else{
+        for(int i = 1; i <= RAID_DISK_NUMBER; i++)
+            raid_lock_write_acquire(&raid_data.locks[i]);
+        for(int i = 1; i <= nd; i++)
+            set_req(&reqs[i - 1], i, row, blks[i - 1], 0);
+        raid_rw(reqs, nd);
+        // RAID0_1 leaves the last disk of an odd number unused, and a
+        // row a reshape has not moved off RAID0 yet has no copies.
+        int used = g->type == RAID1 ? nd : g->type == RAID0_1 ? nd / 2 * 2 : 0;
+        for(int i = 1; i <= used; i++){
+            int first = g->type == RAID1 ? 1 : (i - 1) % (nd / 2) + 1;
+            if(i == first || memcmp(blks[i - 1], blks[first - 1], BSIZE) == 0) continue;
+            bad = 1;
+            set_req(&reqs[n++], i, row, blks[first - 1], 1);
+        }
+    }
+    if(bad && raid_data.scrub_repair){
+        bitmap_mark(row, row);
+        raid_rw(reqs, n);
+    }
+    if(parity_level(g)){
+        raid_lock_write_release(stripe_lock(row));
+    }else{
+        for(int i = 1; i <= RAID_DISK_NUMBER; i++)
+            raid_lock_write_release(&raid_data.locks[i]);
+    }
+    raid_lock_read_release(&raid_data.array_lock);
+    scratch_put(blks, RAID_DISK_NUMBER + 2);
+
+    acquire(&raid_data.daemon_lock);
+    raid_data.scrub_checked++;
+    if(bad){
+        raid_data.scrub_mismatches++;
+        if(raid_data.scrub_repair) raid_data.scrub_repaired++;
+    }
+    release(&raid_data.daemon_lock);
     return 0;
 }
 
+// Pace background work: rate rows per clock tick at most, otherwise
+// just let others run between rows.
+static void raidd_throttle(int* rows, int rate){
+    if(rate > 0 && ++*rows >= rate){
+        *rows = 0;
+        acquire(&tickslock);
+        uint t = ticks;
+        while(ticks == t)
+            sleep(&ticks, &tickslock);
+        release(&tickslock);
+    }else{
+        yield();
+    }
+}
+
+// Rebuild the next row of the disk being rebuilt, finishing the rebuild
+// after its last one.
+static void rebuild_step(uchar* blk, int* rows){
+    acquire(&raid_data.daemon_lock);
+    int diskn = raid_data.rebuild_disk;
+    int row = raid_data.rebuild_cursor;
+    release(&raid_data.daemon_lock);
+
+    int skipped = 0;
+    if(row < RAID_DISK_ROWS && (skipped = rebuild_row(diskn, row, blk)) < 0){
+        // keep the cursor; disk_repaired_raid() picks up from it.
+        acquire(&raid_data.daemon_lock);
+        if(raid_data.rebuild_disk == diskn && raid_data.rebuild_running){
+            raid_data.rebuild_running = 0;
+            printf("raid: rebuild of disk %d stopped at row %d\n", diskn, row);
+        }
+        release(&raid_data.daemon_lock);
+        return;
+    }
+    if(row + 1 >= RAID_DISK_ROWS){
+        raid_lock_write_acquire(&raid_data.array_lock);
+        acquire(&raid_data.daemon_lock);
+        int done = raid_data.rebuild_disk == diskn && raid_data.rebuild_cursor == RAID_DISK_ROWS;
+        if(done){
+            raid_data.failed[diskn] = 0;
+            raid_data.rebuild_disk = 0;
+            raid_data.rebuild_cursor = 0;
+            raid_data.rebuild_running = 0;
+            raid_data.rebuild_partial = 0;
+            // a reshape waiting for the array to be whole goes on.
+            raid_data.reshape_running = raid_data.reshaping && !degraded();
+            // another failed member gets the next spare.
+            spare_takeover();
+        }
+        release(&raid_data.daemon_lock);
+        if(done)
+            sb_write_all();
+        raid_lock_write_release(&raid_data.array_lock);
+    }else if((row + 1) % RAID_SB_CHECKPOINT == 0){
+        raid_lock_read_acquire(&raid_data.array_lock);
+        if(raid_data.rebuild_disk == diskn)
+            sb_write_all();
+        raid_lock_read_release(&raid_data.array_lock);
+    }
+    if(!skipped)
+        raidd_throttle(rows, raid_data.rebuild_rate);
+}
+
+// Resync the next dirty row, skipping clean regions whole.
+static void resync_step(uchar* blk, int* rows){
+    int row = raid_data.resync_cursor;
+    while(row < RAID_DISK_ROWS && !region_dirty(row))
+        row += RAID_REGION_ROWS - row % RAID_REGION_ROWS;
+    if(row < RAID_DISK_ROWS && resync_row(row, blk) < 0){
+        acquire(&raid_data.daemon_lock);
+        if(raid_data.resync_running){
+            raid_data.resync_running = 0;
+            printf("raid: resync stopped at row %d\n", row);
+        }
+        release(&raid_data.daemon_lock);
+        return;
+    }
+    acquire(&raid_data.daemon_lock);
+    raid_data.resync_cursor = row + 1;
+    if(row + 1 >= RAID_DISK_ROWS){
+        raid_data.resync_running = 0;
+        raid_data.resync_cursor = 0;
+    }
+    release(&raid_data.daemon_lock);
+    raidd_throttle(rows, raid_data.rebuild_rate);
+}
+
+// Clear the bitmap once writes have stopped for RAID_BITMAP_DELAY ticks
+// and nothing is missing from any member.
+static void bitmap_settle(void){
+    acquire(&tickslock);
+    while(ticks - raid_data.bitmap_ticks < RAID_BITMAP_DELAY && !raid_data.rebuild_running && !raid_data.resync_running &&
+          !raid_data.reshape_running && !raid_data.scrub_running && !raid_data.cache_dirty)
+        sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    raid_lock_write_acquire(&raid_data.array_lock);
+    acquiresleep(&raid_data.sb_lock);
+    acquire(&raid_data.daemon_lock);
+    int clear = raid_data.booted && raid_data.bitmap_dirty && !degraded() && !raid_data.rebuild_running &&
+                !raid_data.resync_running && !raid_data.cache_dirty && ticks - raid_data.bitmap_ticks >= RAID_BITMAP_DELAY;
+    if(clear)
+        raid_data.bitmap_dirty = 0;
+    release(&raid_data.daemon_lock);
+    if(clear){
+        memset(raid_data.bitmap_next, 0, RAID_BITMAP_BYTES);
+        raid_data.bitmap_events = raid_data.events + 1; // the update below
+        sb_update(0);
+    }
+    releasesleep(&raid_data.sb_lock);
+    raid_lock_write_release(&raid_data.array_lock);
+}
+
+// Scrub the next row, ending the pass after the last one. A scrub
+// stops if the array is no longer whole.
+static void scrub_step(int* rows){
+    int row = raid_data.scrub_cursor;
+    if(row < RAID_DISK_ROWS && scrub_row(row) < 0){
+        acquire(&raid_data.daemon_lock);
+        if(raid_data.scrub_running){
+            raid_data.scrub_running = 0;
+            printf("raid: scrub stopped at row %d\n", row);
+        }
+        release(&raid_data.daemon_lock);
+        return;
+    }
+    acquire(&raid_data.daemon_lock);
+    raid_data.scrub_cursor = row + 1;
+    if(row + 1 >= RAID_DISK_ROWS && raid_data.scrub_running){
+        raid_data.scrub_running = 0;
+        raid_data.scrub_cursor = 0;
+        printf("raid: scrub done, %d rows checked, %d mismatched, %d repaired\n",
+               raid_data.scrub_checked, raid_data.scrub_mismatches, raid_data.scrub_repaired);
+    }
+    release(&raid_data.daemon_lock);
+    raidd_throttle(rows, RAID_SCRUB_RATE);
+}
+
+// Move row reshape_row to the new layout and past the cursor, with the
+// whole array held still. Its blocks all still sit in rows from it on,
+// in the old layout, since a new row holds at least as many as an old
+// one. The new row goes to the backup blocks first, and the superblocks
+// record that before it is written in place, so a crash halfway through
+// the row leaves a whole copy for raid_assemble() to put back.
+static int reshape_move_row(void){
+    struct raid_geom* g = &raid_data.geom;
+    struct disk_req reqs[RAID_DISK_NUMBER], backup[RAID_DISK_NUMBER];
+    uchar* data[RAID_DISK_NUMBER + 2];
+    int queued[RAID_DISK_NUMBER + 1];
+    int disks[RAID_DISK_NUMBER];
+    int w = stripe_width(g), row = raid_data.reshape_row, n = 0;
+
+    raid_lock_write_acquire(&raid_data.array_lock);
+    if(!raid_data.reshaping || !raid_data.reshape_running || degraded() || scratch_get(data, w + 2) < 0){
+        raid_lock_write_release(&raid_data.array_lock);
+        return -1;
+    }
+    // the disks must be current, and row is about to change layout.
+    for(int i = 0; i < RAID_STRIPE_CACHE; i++)
+        cache_flush(&raid_data.cache[i]);
+    cache_drop(row);
+    memset(queued, 0, sizeof(queued));
+    for(int j = 0; j < w; j++){
+        int b = row * w + j, blkNum;
+        if(b >= raid_data.numberOfBlocks){
+            memset(data[j], 0, BSIZE); // past the end of the old layout
+            continue;
+        }
+        int diskNum = read_target(b, &blkNum, queued);
+        set_req(&reqs[n++], diskNum, blkNum, data[j], 0);
+    }
+    raid_rw(reqs, n);
+
+    raid_data.reshape_row = row + 1;
+    n = 0;
+    if(parity_level(g)){
+        uchar* q = g->type == RAID6 ? data[w + 1] : 0;
+        gen_pq(data[w], q, data, w);
+        for(int s = 0; s < g->ndisks; s++)
+            set_req(&reqs[n++], slot_disk(row, s), row, data[s], 1);
+    }else{
+        for(int j = 0; j < w; j++){
+            int blkNum, m = write_targets(row * w + j, disks, &blkNum);
+            for(int i = 0; i < m; i++)
+                set_req(&reqs[n++], disks[i], row, data[j], 1);
+        }
+    }
+    for(int i = 0; i < n; i++){
+        backup[i] = reqs[i];
+        backup[i].blockno = RAID_BACKUP_BLOCK;
+    }
+    raid_rw(backup, n);
+    raid_data.reshape_backup = 1;
+    sb_write_all();
+    raid_rw(reqs, n);
+    raid_data.reshape_backup = 0;
+    if(row + 1 >= RAID_DISK_ROWS){
+        acquire(&raid_data.daemon_lock);
+        raid_data.reshaping = 0;
+        raid_data.reshape_running = 0;
+        raid_data.reshape_row = 0;
+        release(&raid_data.daemon_lock);
+        raid_data.old = *g;
+        raid_data.numberOfBlocks = w * RAID_DISK_ROWS;
+        printf("raid: reshape to level %d over %d disks done\n", g->type, g->ndisks);
+    }
+    sb_write_all();
+    raid_lock_write_release(&raid_data.array_lock);
+    scratch_put(data, w + 2);
+    return 0;
+}
+
+// Move the next row of a reshape. One that can't go on waits for the
+// array to be whole again.
+static void reshape_step(int* rows){
+    if(reshape_move_row() < 0){
+        acquire(&raid_data.daemon_lock);
+        if(raid_data.reshape_running){
+            raid_data.reshape_running = 0;
+            printf("raid: reshape paused at row %d\n", raid_data.reshape_row);
+        }
+        release(&raid_data.daemon_lock);
+        return;
+    }
+    raidd_throttle(rows, raid_data.rebuild_rate);
+}
+
+// Is a row dirty in the stripe cache for RAID_CACHE_DELAY ticks? Looked
+// at without the stripe locks, as a hint.
+static int cache_aged(void){
+    for(int i = 0; i < RAID_STRIPE_CACHE; i++){
+        struct stripe_head* sh = &raid_data.cache[i];
+        if(sh->dirty && ticks - sh->dirty_ticks >= RAID_CACHE_DELAY) return 1;
+    }
+    return 0;
+}
+
+// Write back the rows dirty in the stripe cache for age ticks or more,
+// under the locks a write of them takes.
+static void cache_writeback(uint age){
+    raid_lock_read_acquire(&raid_data.array_lock);
+    for(int i = 0; i < RAID_STRIPE_CACHE; i++){
+        struct stripe_head* sh = &raid_data.cache[i];
+        if(!sh->dirty || ticks - sh->dirty_ticks < age) continue;
+        raid_lock_write_acquire(&sh->lock);
+        if(sh->dirty && ticks - sh->dirty_ticks >= age)
+            cache_flush(sh);
+        raid_lock_write_release(&sh->lock);
+    }
+    raid_lock_read_release(&raid_data.array_lock);
+}
+
+// Write back the rows dirty in the stripe cache for RAID_CACHE_DELAY
+// ticks, waiting for one to get there first if wait is set.
+static void cache_settle(int wait){
+    acquire(&tickslock);
+    while(wait && raid_data.cache_dirty && !cache_aged() && !raid_data.rebuild_running && !raid_data.resync_running &&
+          !raid_data.reshape_running && !raid_data.scrub_running)
+        sleep(&ticks, &tickslock);
+    release(&tickslock);
+    cache_writeback(RAID_CACHE_DELAY);
+}
+
+// Write everything the stripe cache holds dirty to the disks, for
+// callers that need their writes to have reached them.
+int raid_sync(void){
+    if(!raid_data.booted) return -1;
+    cache_writeback(0);
+    return 0;
+}
+
+// The RAID daemon. It rebuilds repaired disks a row at a time while the
+// array stays in use, so I/O only waits for the row being rebuilt.
+// Rows below the cursor are served and written through like any healthy
+// disk's; rows above it are reconstructed or skipped as on a failed one.
+// With nothing to rebuild it resyncs what a crash left dirty, then
+// carries on with a reshape, and clears the write-intent bitmap when the
+// array has gone quiet. A scrub comes last, paced to RAID_SCRUB_RATE
+// rows a tick. Along the way it writes back rows left dirty in the
+// stripe cache.
+static void raidd(void){
+    uchar* blk[1];
+    int rows = 0;
+
+    if(scratch_get(blk, 1) < 0) panic("raidd");
+    for(;;){
+        acquire(&raid_data.daemon_lock);
+        while(!raid_data.rebuild_running && !raid_data.resync_running && !raid_data.reshape_running &&
+              !raid_data.scrub_running && !raid_data.cache_dirty && !(raid_data.bitmap_dirty && !degraded()))
+            sleep(&raid_data.rebuild_running, &raid_data.daemon_lock);
+        int rebuild = raid_data.rebuild_running;
+        int resync = raid_data.resync_running;
+        int reshape = raid_data.reshape_running;
+        int scrub = raid_data.scrub_running;
+        int cache = raid_data.cache_dirty;
+        release(&raid_data.daemon_lock);
+
+        int busy = rebuild || resync || reshape || scrub;
+        if(rebuild)
+            rebuild_step(blk[0], &rows);
+        else if(resync)
+            resync_step(blk[0], &rows);
+        else if(reshape)
+            reshape_step(&rows);
+        else if(scrub)
+            scrub_step(&rows);
+        if(cache)
+            cache_settle(!busy);
+        else if(!busy)
+            bitmap_settle();
+    }
+}
+
+void raidinit(void){
+    gf_init();
+    initlock(&raid_data.daemon_lock, "raidd");
+    initsleeplock(&raid_data.sb_lock, "raid_sb");
+    if(kthread_create("raidd", raidd) < 0)
+        panic("raidinit");
+}
+
 int sys_info_raid_impl(uint *blkn, uint *blks, uint *diskn){
     if(!raid_data.booted) return -1;
-    *diskn = RAID_DISK_NUMBER;
+    *diskn = raid_data.geom.ndisks;
     *blks = BSIZE;
     *blkn = raid_data.numberOfBlocks;
     return 0;
 }
 
+// Copy out the statistics gathered since the array was set up or they
+// were last reset, then reset them if reset is set.
+int sys_stat_raid_impl(struct raid_stat *st, int reset){
+    if(!raid_data.booted) return -1;
+    memmove(st, &raid_data.stats, sizeof(*st));
+    st->hz = RAID_MTIME_HZ;
+    if(reset)
+        memset(&raid_data.stats, 0, sizeof(raid_data.stats));
+    return 0;
+}
+
 int sys_destroy_raid_impl(){
+    if(raid_data.booted){
+        raid_lock_write_acquire(&raid_data.array_lock);
+        acquire(&raid_data.daemon_lock);
+        raid_data.rebuild_disk = 0;
+        raid_data.rebuild_cursor = 0;
+        raid_data.rebuild_running = 0;
+        raid_data.resync_running = 0;
+        raid_data.scrub_running = 0;
+        raid_data.reshaping = 0;
+        raid_data.reshape_running = 0;
+        raid_data.bitmap_dirty = 0;
+        release(&raid_data.daemon_lock);
+        // raidd writes back under array_lock too, so nothing is mid-flush;
+        // what the cache still holds dirty must reach the disks first.
+        for(int i = 0; i < RAID_STRIPE_CACHE; i++)
+            cache_flush(&raid_data.cache[i]);
+        cache_reset();
+        acquiresleep(&raid_data.sb_lock);
+        sb_update(1);
+        releasesleep(&raid_data.sb_lock);
+        raid_lock_write_release(&raid_data.array_lock);
+    }
     raid_data.booted = 0;
     return 0;
 }
\ No newline at end of file
@@ -4,13 +4,87 @@
 
 #ifndef XV6_RISCV_OS2_RSICV_RAID_RAID_H
 #define XV6_RISCV_OS2_RSICV_RAID_RAID_H
-enum RAID_TYPE{RAID0, RAID1, RAID0_1, RAID4, RAID5};
+enum RAID_TYPE{RAID0, RAID1, RAID0_1, RAID4, RAID5, RAID6};
 
-int sys_init_raid_impl(enum RAID_TYPE raid);
+// one block of a readv_raid()/writev_raid() call.
+struct raid_iovec{
+    uint blkn;
+    uint64 addr; // user address of BSIZE bytes
+};
+
+// what stat_raid() reports; its latencies are in ticks of the CLINT's
+// mtime, hz a second, counted in log2 buckets: bucket b holds those
+// under 2^(b+1) ticks, the last one the rest.
+#define RAID_STAT_READ 0        // raid_read_blocks() calls
+#define RAID_STAT_WRITE 1       // raid_write_blocks() calls
+#define RAID_STAT_RECONSTRUCT 2 // blocks read back from the rest of their row
+#define RAID_STAT_REBUILD 3     // rows rebuilt
+#define RAID_STAT_OPS 4
+#define RAID_STAT_BUCKETS 20
+
+struct raid_disk_stat{
+    uint64 reads, writes;           // requests
+    uint64 read_bytes, write_bytes;
+};
+
+struct raid_stat{
+    uint64 hz;
+    struct raid_disk_stat disk[NRAIDDISK + 1]; // by virtio disk, 1 .. NRAIDDISK
+    uint64 cache_hits;              // blocks read from the stripe cache
+    uint64 degraded_reads;          // reads of blocks on failed members
+    uint64 rmw;                     // row writes by read-modify-write
+    uint64 rcw;                     // and by reconstruct-write
+    uint64 ops[RAID_STAT_OPS];
+    uint64 ticks[RAID_STAT_OPS];    // summed latency
+    uint64 hist[RAID_STAT_OPS][RAID_STAT_BUCKETS];
+};
+
+#define RAID_SB_MAGIC 0x44494152 // "RAID"
+#define RAID_SB_VERSION 6
+#define RAID_BITMAP_BYTES 512 // write-intent bitmap, one bit per region
+
+// On-disk superblock, in block 0 of every member of an array. Block 1
+// holds the row a reshape is moving.
+struct raid_super{
+    uint magic;          // RAID_SB_MAGIC
+    uint version;        // RAID_SB_VERSION
+    uint level;          // enum RAID_TYPE
+    uint ndisks;         // members in the array
+    uint chunk;          // stripe unit, in blocks
+    uint disk_blocks;    // blocks of each member in use
+    uint index;          // this member's number, 1 .. ndisks, or 0 on a spare
+    uint failed;         // bit i set if disk i has failed
+    uint64 uuid;         // identifies the array
+    uint64 events;       // generation, bumped on every update
+    uint rebuild_disk;   // disk being rebuilt, 0 if none
+    uint rebuild_cursor; // rows of it rebuilt so far
+    uint rebuild_partial; // only the regions in the bitmap need rebuilding
+    uint64 bitmap_events; // events of the update that last cleared the bitmap
+    uchar bitmap[RAID_BITMAP_BYTES]; // regions written since
+    uint reshaping;      // level and ndisks are what a reshape moves to
+    uint old_level;      // and what it moves from
+    uint old_ndisks;
+    uint reshape_row;    // rows moved so far
+    uint reshape_backup; // block 1 holds row reshape_row - 1
+    uchar dev[NRAIDDISK + 1]; // dev[i] is the disk member i is on
+    uint spares;         // bit d set if disk d is a hot spare
+    uint checksum;       // of everything above
+};
+
+int sys_init_raid_impl(enum RAID_TYPE raid, int chunk, int ndisks, int nspares);
 int sys_read_raid_impl(int blkn, uchar* data);
 int sys_write_raid_impl(int blkn, uchar* data);
+int raid_read_blocks(int blkn, int count, uchar** data);
+int raid_write_blocks(int blkn, int count, uchar** data);
+int raid_sync(void);
 int sys_disk_fail_raid_impl(int diskn);
 int sys_disk_repaired_raid_impl(int diskn);
 int sys_info_raid_impl(uint *blkn, uint *blks, uint *diskn);
+int sys_rebuild_info_raid_impl(uint *diskn, uint *done, uint *total);
+int sys_rebuild_rate_raid_impl(int rows);
+int sys_scrub_raid_impl(int repair);
+int sys_scrub_info_raid_impl(uint *checked, uint *mismatches, uint *repaired);
+int sys_reshape_raid_impl(enum RAID_TYPE raid, int ndisks);
+int sys_stat_raid_impl(struct raid_stat *st, int reset);
 int sys_destroy_raid_impl();
 #endif //XV6_RISCV_OS2_RSICV_RAID_RAID_H
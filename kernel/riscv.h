@@ -47,6 +47,8 @@ w_mepc(uint64 x)
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
 #define SSTATUS_SIE (1L << 1)  // Supervisor Interrupt Enable
 #define SSTATUS_UIE (1L << 0)  // User Interrupt Enable
+#define SSTATUS_VS (3L << 9)   // Vector unit state, 0=Off
+#define SSTATUS_VS_INITIAL (1L << 9)
 
 static inline uint64
 r_sstatus()
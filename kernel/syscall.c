@@ -109,6 +109,17 @@ extern uint64 sys_disk_fail_raid(void);
 extern uint64 sys_disk_repaired_raid(void);
 extern uint64 sys_info_raid(void);
 extern uint64 sys_destroy_raid(void);
+extern uint64 sys_readv_raid(void);
+extern uint64 sys_writev_raid(void);
+extern uint64 sys_rebuild_info_raid(void);
+extern uint64 sys_rebuild_rate_raid(void);
+extern uint64 sys_scrub_raid(void);
+extern uint64 sys_scrub_info_raid(void);
+extern uint64 sys_reshape_raid(void);
+extern uint64 sys_mount_raid(void);
+extern uint64 sys_stat_raid(void);
+extern uint64 sys_poll_raid(void);
+extern uint64 sys_sched_raid(void);
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
 static uint64 (*syscalls[])(void) = {
@@ -140,7 +151,18 @@ static uint64 (*syscalls[])(void) = {
 [SYS_disk_fail_raid] sys_disk_fail_raid,
 [SYS_disk_repaired_raid] sys_disk_repaired_raid,
 [SYS_info_raid] sys_info_raid,
-[SYS_destroy_raid] sys_destroy_raid
+[SYS_destroy_raid] sys_destroy_raid,
+[SYS_readv_raid] sys_readv_raid,
+[SYS_writev_raid] sys_writev_raid,
+[SYS_rebuild_info_raid] sys_rebuild_info_raid,
+[SYS_rebuild_rate_raid] sys_rebuild_rate_raid,
+[SYS_scrub_raid] sys_scrub_raid,
+[SYS_scrub_info_raid] sys_scrub_info_raid,
+[SYS_reshape_raid] sys_reshape_raid,
+[SYS_mount_raid] sys_mount_raid,
+[SYS_stat_raid] sys_stat_raid,
+[SYS_poll_raid] sys_poll_raid,
+[SYS_sched_raid] sys_sched_raid
 };
 
 void
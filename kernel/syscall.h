@@ -27,3 +27,14 @@
 #define SYS_disk_repaired_raid 26
 #define SYS_info_raid 27
 #define SYS_destroy_raid 28
+#define SYS_readv_raid 29
+#define SYS_writev_raid 30
+#define SYS_rebuild_info_raid 31
+#define SYS_rebuild_rate_raid 32
+#define SYS_scrub_raid 33
+#define SYS_scrub_info_raid 34
+#define SYS_reshape_raid 35
+#define SYS_mount_raid 36
+#define SYS_stat_raid 37
+#define SYS_poll_raid 38
+#define SYS_sched_raid 39
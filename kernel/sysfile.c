@@ -503,3 +503,24 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Mount the file system on the RAID array on directory path.
+uint64
+sys_mount_raid(void)
+{
+  char path[MAXPATH];
+  struct inode *ip;
+
+  begin_op();
+  if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  if(fsmount(RAIDDEV, ip) < 0){
+    iput(ip);
+    end_op();
+    return -1;
+  }
+  end_op();
+  return 0;
+}
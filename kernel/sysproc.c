@@ -93,20 +93,27 @@ sys_uptime(void)
 }
 
 uint64 sys_init_raid(void){
-    int raid_level;
+    int raid_level, chunk, ndisks, nspares;
     argint(0, &raid_level);
-    return sys_init_raid_impl(raid_level);
+    argint(1, &chunk);
+    argint(2, &ndisks);
+    argint(3, &nspares);
+    return sys_init_raid_impl(raid_level, chunk, ndisks, nspares);
 }
 
 uint64 sys_read_raid(void){
 
     int blkNum;
     uint64 addr;
-    uchar buffer[BSIZE];
+    uchar *buffer;
     argint(0, &blkNum);
     argaddr(1, &addr);
+    // stage in a direct-mapped page so the disks can DMA into it.
+    if((buffer = kalloc()) == 0)
+        return -1;
     int return_val = sys_read_raid_impl(blkNum, buffer);
     copyout(myproc()->pagetable, addr, (char*) buffer, BSIZE);
+    kfree(buffer);
     return return_val;
 }
 
@@ -114,11 +121,16 @@ uint64 sys_write_raid(void) {
 
     int blkNum;
     uint64 addr;
-    uchar buffer[BSIZE];
+    uchar *buffer;
     argint(0, &blkNum);
     argaddr(1, &addr);
+    // raw writes would go behind the back of a mounted file system.
+    if(fsmounted(RAIDDEV) || (buffer = kalloc()) == 0)
+        return -1;
     copyin(myproc()->pagetable, (char*) buffer, addr, BSIZE);
-    return sys_write_raid_impl(blkNum,  buffer);
+    int return_val = sys_write_raid_impl(blkNum,  buffer);
+    kfree(buffer);
+    return return_val;
 }
 
 uint64 sys_disk_fail_raid(void){
@@ -149,5 +161,162 @@ uint64 sys_info_raid(void){
     return return_val;
 }
 
-uint64 sys_destroy_raid(void){return sys_destroy_raid_impl();}
+uint64 sys_stat_raid(void){
+    uint64 addr;
+    int reset;
+    struct raid_stat *st;
+    argaddr(0, &addr);
+    argint(1, &reset);
+    if((st = kalloc()) == 0)
+        return -1;
+    int return_val = sys_stat_raid_impl(st, reset);
+    if(return_val == 0 && copyout(myproc()->pagetable, addr, (char*) st, sizeof(*st)) < 0)
+        return_val = -1;
+    kfree(st);
+    return return_val;
+}
+
+// Set how waiters on virtio disk diskn learn that their requests are
+// done: by interrupt, by polling, or by polling when its queue is deep.
+uint64 sys_poll_raid(void){
+    int diskn, mode;
+    argint(0, &diskn);
+    argint(1, &mode);
+    return virtio_disk_poll(diskn, mode);
+}
+
+// Set the order the requests queued for virtio disk diskn go to it in:
+// as they came, deadline, or C-LOOK.
+uint64 sys_sched_raid(void){
+    int diskn, sched;
+    argint(0, &diskn);
+    argint(1, &sched);
+    return virtio_disk_sched(diskn, sched);
+}
+
+uint64 sys_destroy_raid(void){
+    if(fsmounted(RAIDDEV)) return -1;
+    return sys_destroy_raid_impl();
+}
+
+
+#define RAID_IOV_BATCH 16 // iovec entries staged per round
+
+// Move the blocks named by the user iovec at uiov between the array and
+// their user buffers. Entries are staged RAID_IOV_BATCH at a time in
+// direct-mapped pages, and each run of consecutive block numbers goes to
+// the RAID layer as one request so that its disk I/O runs in parallel.
+static int raid_iov(uint64 uiov, int iovcnt, int write){
+    struct proc *p = myproc();
+    struct raid_iovec iov[RAID_IOV_BATCH];
+    uchar *pages[RAID_IOV_BATCH * BSIZE / PGSIZE];
+    uchar *blks[RAID_IOV_BATCH];
+    int npages = RAID_IOV_BATCH * BSIZE / PGSIZE;
+    int ret = 0;
+
+    if(iovcnt < 0)
+        return -1;
+    for(int i = 0; i < npages; i++){
+        if((pages[i] = kalloc()) == 0){
+            while(--i >= 0)
+                kfree(pages[i]);
+            return -1;
+        }
+    }
+    for(int i = 0; i < RAID_IOV_BATCH; i++)
+        blks[i] = pages[i / (PGSIZE / BSIZE)] + (i % (PGSIZE / BSIZE)) * BSIZE;
+
+    for(int done = 0; done < iovcnt && ret == 0; done += RAID_IOV_BATCH){
+        int n = iovcnt - done < RAID_IOV_BATCH ? iovcnt - done : RAID_IOV_BATCH;
+        if(copyin(p->pagetable, (char*) iov, uiov + done * sizeof(struct raid_iovec), n * sizeof(struct raid_iovec)) < 0){
+            ret = -1;
+            break;
+        }
+        for(int i = 0; write && i < n && ret == 0; i++)
+            ret = copyin(p->pagetable, (char*) blks[i], iov[i].addr, BSIZE);
+        for(int i = 0, j; i < n && ret == 0; i = j){
+            for(j = i + 1; j < n && iov[j].blkn == iov[j - 1].blkn + 1; j++)
+                ;
+            if(write)
+                ret = raid_write_blocks(iov[i].blkn, j - i, &blks[i]);
+            else
+                ret = raid_read_blocks(iov[i].blkn, j - i, &blks[i]);
+        }
+        for(int i = 0; !write && i < n && ret == 0; i++)
+            ret = copyout(p->pagetable, iov[i].addr, (char*) blks[i], BSIZE);
+    }
+
+    for(int i = 0; i < npages; i++)
+        kfree(pages[i]);
+    return ret;
+}
 
+uint64 sys_readv_raid(void){
+    uint64 iov;
+    int iovcnt;
+    argaddr(0, &iov);
+    argint(1, &iovcnt);
+    return raid_iov(iov, iovcnt, 0);
+}
+
+uint64 sys_writev_raid(void){
+    uint64 iov;
+    int iovcnt;
+    argaddr(0, &iov);
+    argint(1, &iovcnt);
+    if(fsmounted(RAIDDEV)) return -1;
+    return raid_iov(iov, iovcnt, 1);
+}
+
+uint64 sys_rebuild_info_raid(void){
+    uint64 diskNum;
+    uint64 done;
+    uint64 total;
+    uint arg0, arg1, arg2;
+    argaddr(0, &diskNum);
+    argaddr(1, &done);
+    argaddr(2, &total);
+    int return_val = sys_rebuild_info_raid_impl(&arg0, &arg1, &arg2);
+    if(return_val < 0) return -1;
+    if(copyout(myproc()->pagetable, diskNum, (char*) &arg0, sizeof(uint)) < 0 ||
+       copyout(myproc()->pagetable, done, (char*) &arg1, sizeof(uint)) < 0 ||
+       copyout(myproc()->pagetable, total, (char*) &arg2, sizeof(uint)) < 0)
+        return -1;
+    return 0;
+}
+
+uint64 sys_rebuild_rate_raid(void){
+    int rows;
+    argint(0, &rows);
+    return sys_rebuild_rate_raid_impl(rows);
+}
+
+uint64 sys_scrub_raid(void){
+    int repair;
+    argint(0, &repair);
+    return sys_scrub_raid_impl(repair);
+}
+
+uint64 sys_scrub_info_raid(void){
+    uint64 checked;
+    uint64 mismatches;
+    uint64 repaired;
+    uint arg0, arg1, arg2;
+    argaddr(0, &checked);
+    argaddr(1, &mismatches);
+    argaddr(2, &repaired);
+    int return_val = sys_scrub_info_raid_impl(&arg0, &arg1, &arg2);
+    if(return_val < 0) return -1;
+    if(copyout(myproc()->pagetable, checked, (char*) &arg0, sizeof(uint)) < 0 ||
+       copyout(myproc()->pagetable, mismatches, (char*) &arg1, sizeof(uint)) < 0 ||
+       copyout(myproc()->pagetable, repaired, (char*) &arg2, sizeof(uint)) < 0)
+        return -1;
+    return return_val;
+}
+
+uint64 sys_reshape_raid(void){
+    int raid_level, ndisks;
+    argint(0, &raid_level);
+    argint(1, &ndisks);
+    return sys_reshape_raid_impl(raid_level, ndisks);
+}
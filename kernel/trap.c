@@ -169,6 +169,14 @@ clockintr()
   release(&tickslock);
 }
 
+// the CLINT's mtime, which counts at 10 MHz on every hart
+// of qemu's virt machine, for timing things finer than ticks.
+uint64
+mtime(void)
+{
+  return *(volatile uint64*) CLINT_MTIME;
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
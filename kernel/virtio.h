@@ -29,6 +29,14 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION	0x0fc // changes when the configuration does
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration space
+
+// virtio-blk configuration space: the capacity comes first, a 64-bit
+// count of 512-byte sectors.
+#define VIRTIO_BLK_CONFIG_CAPACITY	0x000
+#define VIRTIO_BLK_CONFIG_SEG_MAX	0x00c // 32-bit, with VIRTIO_BLK_F_SEG_MAX
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES	0x022 // 16-bit, with VIRTIO_BLK_F_MQ
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -37,6 +45,7 @@
 #define VIRTIO_CONFIG_S_FEATURES_OK	8
 
 // device feature bits
+#define VIRTIO_BLK_F_SEG_MAX         2	/* Maximum data segments per request in config */
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
@@ -49,6 +58,11 @@
 // must be a power of two.
 #define NUM 16
 
+// at most this many blocks of consecutive sectors go in a single
+// disk request. with their header and status, one request's
+// descriptors fill the ring, or a NUMth of a page of indirect tables.
+#define NSEG (NUM - 2)
+
 // a single descriptor, from the spec.
 struct virtq_desc {
   uint64 addr;
@@ -58,13 +72,14 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX, interrupt once used idx passes this
 };
 
 // one entry in the "used" ring, with which the
@@ -78,8 +93,18 @@ struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX, notify once avail idx passes this
 };
 
+// with EVENT_IDX, should the other side be told that idx has
+// moved from old to new, given that it asked to hear once it
+// passes event? from the spec, and safe across wrap-around.
+static inline int
+vring_need_event(uint16 event, uint16 new, uint16 old)
+{
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
+
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
@@ -87,8 +112,8 @@ struct virtq_used {
 #define VIRTIO_BLK_T_OUT 1 // write the disk
 
 // the format of the first descriptor in a disk request.
-// to be followed by two more descriptors containing
-// the block, and a one-byte status.
+// to be followed by descriptors containing the blocks,
+// one each, and a one-byte status.
 struct virtio_blk_req {
   uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
   uint32 reserved;
@@ -19,9 +19,21 @@
 // the address of virtio mmio register r.
 #define R(offset,r) ((volatile uint32 *)(VIRTIO0 + VIRTIO_OFFSET * offset + (r)))
 
-static struct disk {
-  // Name of the disk to be used with panic and spinlock
-  char *name;
+// a request waiting on a virtqueue for the device.
+struct qent {
+  struct disk_req *r;
+  uint64 deadline;    // when deadline scheduling must take it
+  struct qent *next;
+};
+
+// queue entries a virtqueue has, in a page of their own.
+#define NQUEUE (PGSIZE / sizeof(struct qent))
+
+// one of a disk's virtqueues, each with its own lock, so that
+// harts submitting to different queues don't contend.
+struct vq {
+  int id; // the disk's
+  int n;  // the queue's number on it
 
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
@@ -49,32 +61,215 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct disk_req *r[NSEG]; // done together, one block each
+    int n;
     char status;
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
-  struct spinlock vdisk_lock;
+
+  // with INDIRECT_DESC a request takes a single ring descriptor,
+  // which points at its own table, here. indexed like info.
+  struct virtq_desc (*itab)[NSEG + 2];
+
+  struct spinlock lock;
+
+  int inflight; // requests on the avail ring not yet reaped
+
+  // requests waiting for the device, in the order they came.
+  // the disk's sched picks which goes next.
+  struct qent *ents; // NQUEUE of them
+  struct qent *queue;
+  struct qent *freeq;
+  uint pos;     // the block after the last one sent
+  int starved;  // read batches sent while writes waited
+};
+
+static struct disk {
+  // Name of the disk to be used with panic and spinlock
+  char *name;
+
+  // with MQ, one virtqueue per hart, as far as the device goes.
+  struct vq q[NCPU];
+  int nvq;
+
+  int indirect; // negotiated INDIRECT_DESC?
+
+  int nseg; // blocks the device takes in one request, at most NSEG
+
+  // with EVENT_IDX the device and driver say how far the other
+  // may get before it must notify, or interrupt, again.
+  int event_idx;
+
+  uint64 blocks; // capacity, in BSIZE blocks
+
+  // set under all the queues' locks.
+  int poll;     // VIRTIO_POLL_OFF, _ON or _ADAPTIVE
+  struct sched *sched;
   
 } disk[VIRTIO_RAID_DISK_END + 1];
 
-static struct buf* transfer_buffer[VIRTIO_RAID_DISK_END + 1];
+static struct qent **pick_noop(struct vq *);
+static struct qent **pick_deadline(struct vq *);
+static struct qent **pick_clook(struct vq *);
+
+// the request queue disciplines, indexed by VIRTIO_SCHED_*.
+// pick() returns the link to the queued request that is to
+// go to the device next; the queued requests for the blocks
+// after it then go along with it.
+static struct sched {
+  struct qent **(*pick)(struct vq *q);
+} scheds[] = {
+[VIRTIO_SCHED_NOOP]     { pick_noop },
+[VIRTIO_SCHED_DEADLINE] { pick_deadline },
+[VIRTIO_SCHED_CLOOK]    { pick_clook },
+};
+
+// deadline scheduling sends reads first, sorted by block, but
+// takes any request that has waited longer than its expiry, in
+// ticks of mtime, and lets writes go after DEADLINE_STARVED
+// batches of reads have passed them by.
+#define DEADLINE_READ_EXPIRE 50000   // 5 ms
+#define DEADLINE_WRITE_EXPIRE 500000 // 50 ms
+#define DEADLINE_STARVED 2
+
+// a waiter on a polled disk spins on the used ring for up to
+// VIRTIO_POLL_SPIN ticks of the CLINT's mtime (10 MHz under
+// qemu) before it goes to sleep for the interrupt. adaptive
+// polling does so only once VIRTIO_POLL_DEPTH requests are in
+// flight, when completions come often enough to be worth it.
+#define VIRTIO_POLL_SPIN 500
+#define VIRTIO_POLL_DEPTH 4
+
+// how many RAID disks have been set up, in slots
+// VIRTIO_RAID_DISK_START and on.
+static int nraid;
+
+// bounce blocks for RAID transfers whose data the device can't
+// reach directly, e.g. buffers on a kernel stack. they live in
+// the kernel's bss, which is direct-mapped, so the device can
+// DMA into them.
+#define NBOUNCE 32
+
+static struct {
+  struct spinlock lock;
+  char free[NBOUNCE];
+  int nfree;
+  uchar *orig[NBOUNCE]; // the data each block in use stands in for
+  uchar data[NBOUNCE][BSIZE];
+} bounce;
+
+// is there a virtio block device in mmio slot id?
+int
+virtio_disk_probe(int id)
+{
+  return *R(id, VIRTIO_MMIO_MAGIC_VALUE) == 0x74726976 &&
+         *R(id, VIRTIO_MMIO_VERSION) == 2 &&
+         *R(id, VIRTIO_MMIO_DEVICE_ID) == 2 &&
+         *R(id, VIRTIO_MMIO_VENDOR_ID) == 0x554d4551;
+}
+
+// read the disk's capacity from its configuration space. the
+// device may change it between the two halves, so read again
+// until the generation count says it hasn't.
+static uint64
+read_capacity(int id)
+{
+  uint32 gen, lo, hi;
+
+  do {
+    gen = *R(id, VIRTIO_MMIO_CONFIG_GENERATION);
+    lo = *R(id, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY);
+    hi = *R(id, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY + 4);
+  } while(gen != *R(id, VIRTIO_MMIO_CONFIG_GENERATION));
+  return ((uint64)hi << 32 | lo) / (BSIZE / 512);
+}
+
+// set up virtqueue n of disk id.
+static void
+vq_init(int id, int n)
+{
+  struct vq *q = &disk[id].q[n];
+
+  initlock(&q->lock, disk[id].name);
+  q->id = id;
+  q->n = n;
+
+  // initialize queue n.
+  *R(id, VIRTIO_MMIO_QUEUE_SEL) = n;
+
+  // ensure queue n is not in use.
+  if(*R(id, VIRTIO_MMIO_QUEUE_READY))
+      panic_concat(2, disk[id].name, ": virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(id, VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+      panic_concat(2, disk[id].name, ": virtio disk has no queue");
+  if(max < NUM)
+      panic_concat(2, disk[id].name, ": virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  q->desc = kalloc();
+  q->avail = kalloc();
+  q->used = kalloc();
+  if(!q->desc || !q->avail || !q->used)
+      panic_concat(2, disk[id].name, ": virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+
+  // NUM tables of NSEG + 2 descriptors fit in a page.
+  if(disk[id].indirect){
+    if((q->itab = kalloc()) == 0)
+      panic_concat(2, disk[id].name, ": virtio disk kalloc");
+    memset(q->itab, 0, PGSIZE);
+  }
+
+  if((q->ents = kalloc()) == 0)
+    panic_concat(2, disk[id].name, ": virtio disk kalloc");
+  for(int i = 0; i < NQUEUE; i++){
+    q->ents[i].next = q->freeq;
+    q->freeq = &q->ents[i];
+  }
+
+  // set queue size.
+  *R(id, VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(id, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(id, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(id, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(id, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(id, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(id, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // queue is ready.
+  *R(id, VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+}
 
 void
 virtio_disk_init(int id, char * name)
 {
   uint32 status = 0;
 
-  initlock(&disk[id].vdisk_lock, name);
   disk[id].name = name;
 
-  if(*R(id, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(id, VIRTIO_MMIO_VERSION) != 2 ||
-     *R(id, VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(id, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
+  // the program disk is always set up first.
+  if(id == VIRTIO0_ID){
+    initlock(&bounce.lock, "bounce");
+    for(int i = 0; i < NBOUNCE; i++)
+      bounce.free[i] = 1;
+    bounce.nfree = NBOUNCE;
+  }
+
+  if(!virtio_disk_probe(id)){
     panic_concat(2, "could not find virtio disk: ", name);
   }
   
@@ -94,11 +289,25 @@ virtio_disk_init(int id, char * name)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(id, VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk[id].event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+  disk[id].indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+
+  // a device that doesn't say how many data segments it takes
+  // gets one per request.
+  disk[id].nseg = 1;
+  if(features & (1 << VIRTIO_BLK_F_SEG_MAX)){
+    uint32 max = *R(id, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_SEG_MAX);
+    disk[id].nseg = max < 1 ? 1 : max > NSEG ? NSEG : max;
+  }
+
+  // with MQ, a queue for each hart, if the device has that many.
+  disk[id].nvq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    uint16 nq = *(volatile uint16 *)R(id, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    disk[id].nvq = nq < 1 ? 1 : nq > NCPU ? NCPU : nq;
+  }
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -109,72 +318,44 @@ virtio_disk_init(int id, char * name)
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
       panic_concat(2, name, ": virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(id, VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(id, VIRTIO_MMIO_QUEUE_READY))
-      panic_concat(2, name, ": virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(id, VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-      panic_concat(2, name, ": virtio disk has no queue 0");
-  if(max < NUM)
-      panic_concat(2, name, ": virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk[id].desc = kalloc();
-  disk[id].avail = kalloc();
-  disk[id].used = kalloc();
-  if(!disk[id].desc || !disk[id].avail || !disk[id].used)
-      panic_concat(2, name, ": virtio disk kalloc");
-  memset(disk[id].desc, 0, PGSIZE);
-  memset(disk[id].avail, 0, PGSIZE);
-  memset(disk[id].used, 0, PGSIZE);
-
-  // set queue size.
-  *R(id, VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(id, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk[id].desc;
-  *R(id, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk[id].desc >> 32;
-  *R(id, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk[id].avail;
-  *R(id, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk[id].avail >> 32;
-  *R(id, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk[id].used;
-  *R(id, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk[id].used >> 32;
-
-  // queue is ready.
-  *R(id, VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  disk[id].blocks = read_capacity(id);
+  disk[id].sched = &scheds[VIRTIO_SCHED_DEADLINE];
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk[id].free[i] = 1;
+  for(int i = 0; i < disk[id].nvq; i++)
+    vq_init(id, i);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
   *R(id, VIRTIO_MMIO_STATUS) = status;
 
-  if (id >= VIRTIO_RAID_DISK_START) {
-    transfer_buffer[id] = kalloc();
-    if (!transfer_buffer[id]) {
-      panic("virtio_disk_init: kalloc of transfer_buffer failed");
-    }
-
-    memset(transfer_buffer[id], 0, BSIZE);
-    initsleeplock(&transfer_buffer[id]->lock, "transfer_buffer");
-  }
+  if(id >= VIRTIO_RAID_DISK_START)
+    nraid++;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ and VIRTIO1_IRQ.
 }
 
+// the capacity of disk id, in BSIZE blocks.
+uint64
+virtio_disk_blocks(int id)
+{
+  return disk[id].blocks;
+}
+
+// how many RAID disks were found at boot. they are disks
+// VIRTIO_RAID_DISK_START .. VIRTIO_RAID_DISK_START + n - 1.
+int
+virtio_raid_disks(void)
+{
+  return nraid;
+}
+
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc(int id)
+alloc_desc(struct vq *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk[id].free[i]){
-      disk[id].free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -183,29 +364,27 @@ alloc_desc(int id)
 
 // mark a descriptor as free.
 static void
-free_desc(int id, int i)
+free_desc(struct vq *q, int i)
 {
   if(i >= NUM)
-    panic_concat(2, disk[id].name, ": free_desc 1");
-  if(disk[id].free[i])
-      panic_concat(2, disk[id].name, ": free_desc 2");
-  disk[id].desc[i].addr = 0;
-  disk[id].desc[i].len = 0;
-  disk[id].desc[i].flags = 0;
-  disk[id].desc[i].next = 0;
-  disk[id].free[i] = 1;
-
-  wakeup(&disk[id].free[0]);
+    panic_concat(2, disk[q->id].name, ": free_desc 1");
+  if(q->free[i])
+      panic_concat(2, disk[q->id].name, ": free_desc 2");
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int id, int i)
+free_chain(struct vq *q, int i)
 {
   while(1){
-    int flag = disk[id].desc[i].flags;
-    int nxt = disk[id].desc[i].next;
-    free_desc(id, i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -213,124 +392,625 @@ free_chain(int id, int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate the ring descriptors for a request of nseg blocks:
+// nseg + 2 (they need not be contiguous), or with INDIRECT_DESC
+// just one.
 static int
-alloc3_desc(int id, int *idx)
+alloc_req_desc(struct vq *q, int nseg, int *idx)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc(id);
+  int n = disk[q->id].indirect ? 1 : nseg + 2;
+
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(id, idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(int id, struct buf *b, int write)
+// format the descriptors of a request for the n blocks queued
+// in run[0 .. n), which are consecutive on the disk and go the
+// same way, and put it on the avail ring. the caller holds
+// q->lock and must kick() the device afterwards.
+static void
+virtio_disk_start(struct vq *q, struct qent **run, int n, int *idx)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk[id].vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(id, idx) == 0) {
-      break;
+  struct disk_req *r = run[0]->r;
+  uint64 sector = r->blockno * (BSIZE / 512);
+  struct virtq_desc *d[NSEG + 2];
+  int nd = n + 2;
+
+  // the spec's Section 5.2 says that block operations use one
+  // descriptor for type/reserved/sector, then one for each data
+  // segment, then one for a 1-byte status result.
+
+  if(disk[q->id].indirect){
+    // the ring descriptor points at the request's own table.
+    struct virtq_desc *t = q->itab[idx[0]];
+    q->desc[idx[0]].addr = (uint64) t;
+    q->desc[idx[0]].len = nd * sizeof(struct virtq_desc);
+    q->desc[idx[0]].flags = VRING_DESC_F_INDIRECT;
+    q->desc[idx[0]].next = 0;
+    for(int i = 0; i < nd; i++){
+      d[i] = &t[i];
+      d[i]->next = i + 1;
+    }
+  } else {
+    for(int i = 0; i < nd; i++){
+      d[i] = &q->desc[idx[i]];
+      d[i]->next = i + 1 < nd ? idx[i + 1] : 0;
     }
-
-    sleep(&disk[id].free[0], &disk[id].vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk[id].ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[idx[0]];
 
-  if(write)
+  if(r->write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
     buf0->type = VIRTIO_BLK_T_IN; // read the disk
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk[id].desc[idx[0]].addr = (uint64) buf0;
-  disk[id].desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk[id].desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk[id].desc[idx[0]].next = idx[1];
+  d[0]->addr = (uint64) buf0;
+  d[0]->len = sizeof(struct virtio_blk_req);
+  d[0]->flags = VRING_DESC_F_NEXT;
 
-  disk[id].desc[idx[1]].addr = (uint64) b->data;
-  disk[id].desc[idx[1]].len = BSIZE;
-  if(write)
-    disk[id].desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk[id].desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk[id].desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk[id].desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    d[1 + i]->addr = (uint64) run[i]->r->data;
+    d[1 + i]->len = BSIZE;
+    if(r->write)
+      d[1 + i]->flags = 0; // device reads the data
+    else
+      d[1 + i]->flags = VRING_DESC_F_WRITE; // device writes the data
+    d[1 + i]->flags |= VRING_DESC_F_NEXT;
+    q->info[idx[0]].r[i] = run[i]->r;
+  }
 
-  disk[id].info[idx[0]].status = 0xff; // device writes 0 on success
-  disk[id].desc[idx[2]].addr = (uint64) &disk[id].info[idx[0]].status;
-  disk[id].desc[idx[2]].len = 1;
-  disk[id].desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk[id].desc[idx[2]].next = 0;
+  q->info[idx[0]].status = 0xff; // device writes 0 on success
+  d[nd - 1]->addr = (uint64) &q->info[idx[0]].status;
+  d[nd - 1]->len = 1;
+  d[nd - 1]->flags = VRING_DESC_F_WRITE; // device writes the status
+  d[nd - 1]->next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk[id].info[idx[0]].b = b;
+  // record the requests for reap().
+  q->info[idx[0]].n = n;
+  q->inflight++;
+  q->pos = run[n - 1]->r->blockno + 1;
 
   // tell the device the first index in our chain of descriptors.
-  disk[id].avail->ring[disk[id].avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk[id].avail->idx += 1; // not % NUM ...
+  q->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
+}
 
-  *R(id, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// tell the device about the avail ring entries published on q
+// since avail idx old, unless with EVENT_IDX it has said it
+// will find them by itself.
+static void
+kick(struct vq *q, uint16 old)
+{
+  uint16 new = q->avail->idx;
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  sleep(b, &disk[id].vdisk_lock);
+  __sync_synchronize();
+  if(new != old && (!disk[q->id].event_idx ||
+                    vring_need_event(q->used->avail_event, new, old)))
+    *R(q->id, VIRTIO_MMIO_QUEUE_NOTIFY) = q->n; // value is queue number
+}
 
-  disk[id].info[idx[0]].b = 0;
-  free_chain(id, idx[0]);
+// take requests in the order they came.
+static struct qent **
+pick_noop(struct vq *q)
+{
+  return &q->queue;
+}
 
-  release(&disk[id].vdisk_lock);
+// the queued request with the lowest block at or past where the
+// disk got to, or failing that the lowest of all, among those
+// going the given way, or either way if write is -1.
+static struct qent **
+clook(struct vq *q, int write)
+{
+  struct qent **l, **ahead = 0, **lowest = 0;
+
+  for(l = &q->queue; *l; l = &(*l)->next){
+    if(write >= 0 && (*l)->r->write != write)
+      continue;
+    if((*l)->r->blockno >= q->pos &&
+       (ahead == 0 || (*l)->r->blockno < (*ahead)->r->blockno))
+      ahead = l;
+    if(lowest == 0 || (*l)->r->blockno < (*lowest)->r->blockno)
+      lowest = l;
+  }
+  return ahead ? ahead : lowest;
 }
 
-void write_block(int diskn, int blockno, uchar* data) {
-    struct buf *b = transfer_buffer[diskn];
+// sweep up the disk, then start again from the bottom.
+static struct qent **
+pick_clook(struct vq *q)
+{
+  return clook(q, -1);
+}
 
-    if(!b) printf(" %d %d ", diskn, blockno);
-    b->blockno = blockno;
+static struct qent **
+pick_deadline(struct vq *q)
+{
+  struct qent **l, **read = 0, **write = 0;
+  uint64 now = mtime();
+
+  // the oldest request each way, since the queue is in the
+  // order they came.
+  for(l = &q->queue; *l && (read == 0 || write == 0); l = &(*l)->next){
+    if((*l)->r->write && write == 0)
+      write = l;
+    if(!(*l)->r->write && read == 0)
+      read = l;
+  }
+  if(read && (*read)->deadline <= now)
+    return read;
+  if(write && (*write)->deadline <= now)
+    return write;
+
+  if(read && (write == 0 || q->starved < DEADLINE_STARVED)){
+    if(write)
+      q->starved++;
+    return clook(q, 0);
+  }
+  q->starved = 0;
+  return clook(q, 1);
+}
 
-    memmove(b->data, data, BSIZE);
+// add r to the end of q's queue, in a free entry. the caller
+// holds q->lock and has seen there is one.
+static void
+enqueue(struct vq *q, struct disk_req *r)
+{
+  struct qent *e = q->freeq, **l;
+
+  q->freeq = e->next;
+  e->r = r;
+  e->next = 0;
+  e->deadline = mtime() +
+    (r->write ? DEADLINE_WRITE_EXPIRE : DEADLINE_READ_EXPIRE);
+  r->done = 0;
+  for(l = &q->queue; *l; l = &(*l)->next)
+    ;
+  *l = e;
+}
 
-    virtio_disk_rw(diskn, b, 1);
+// gather the request of e and the queued ones for the blocks
+// after it that go the same way, up to what the device takes
+// in one request, into run. returns how many.
+static int
+find_run(struct vq *q, struct qent *e, struct qent **run)
+{
+  struct qent *nx;
+  int n = 0;
+
+  do {
+    run[n++] = e;
+    for(nx = q->queue; nx; nx = nx->next){
+      if(nx->r->write == e->r->write && nx->r->blockno == e->r->blockno + 1)
+        break;
+    }
+    e = nx;
+  } while(e && n < disk[q->id].nseg);
+  return n;
+}
+
+// take e off q's queue and free it.
+static void
+dequeue(struct vq *q, struct qent *e)
+{
+  struct qent **l;
+
+  for(l = &q->queue; *l != e; l = &(*l)->next)
+    ;
+  *l = e->next;
+  e->next = q->freeq;
+  q->freeq = e;
+  wakeup(&q->freeq);
+}
+
+// move queued requests to the device for as long as there are
+// descriptors for them. the caller holds q->lock.
+static void
+dispatch(struct vq *q)
+{
+  uint16 old = q->avail->idx;
+
+  while(q->queue){
+    struct qent *run[NSEG];
+    int idx[NSEG + 2];
+
+    int n = find_run(q, *disk[q->id].sched->pick(q), run);
+    if(alloc_req_desc(q, n, idx) != 0)
+      break; // reap() calls again when some come back
+    virtio_disk_start(q, run, n, idx);
+    for(int i = 0; i < n; i++)
+      dequeue(q, run[i]);
+  }
+
+  kick(q, old);
+}
+
+static void reap(struct vq *);
+
+// the queue of disk id for this hart's requests.
+static struct vq *
+myvq(int id)
+{
+  push_off();
+  int c = cpuid();
+  pop_off();
+  return &disk[id].q[c % disk[id].nvq];
+}
+
+// hand n requests to their disks without waiting for them
+// to finish. each disk's requests join the queue of this
+// hart's virtqueue together, and from there go to the device
+// in the order its scheduler says, runs of them for
+// consecutive blocks as single requests. each r->data must
+// be physical memory the device can reach.
+void
+virtio_disk_submit(struct disk_req *reqs, int n)
+{
+  int i = 0;
+
+  while(i < n){
+    int id = reqs[i].diskn;
+    struct vq *q = myvq(id);
+
+    acquire(&q->lock);
+    int idle = q->inflight == 0;
+    for(; i < n && reqs[i].diskn == id; i++){
+      // the queue empties as the device takes its requests.
+      while(q->freeq == 0){
+        dispatch(q);
+        sleep(&q->freeq, &q->lock);
+      }
+      enqueue(q, &reqs[i]);
+    }
+    dispatch(q);
+
+    // on an idle disk, ask for a single interrupt once the
+    // whole batch is done. requests already in flight have
+    // theirs coming, and must not have it pushed back.
+    if(disk[q->id].event_idx && idle)
+      reap(q);
+
+    release(&q->lock);
+  }
+}
+
+// finish the requests the device has put on the used ring,
+// and send queued ones in their place. with EVENT_IDX, then ask
+// to be interrupted at the next completion if more are queued,
+// else only once all that are in flight are done, and look
+// again in case they finished before the device saw that. the
+// caller holds q->lock.
+static void
+reap(struct vq *q)
+{
+  do {
+    // the device increments disk.used->idx when it
+    // adds an entry to the used ring.
+
+    while(q->used_idx != q->used->idx){
+      __sync_synchronize();
+      int idx = q->used->ring[q->used_idx % NUM].id;
+
+      if(q->info[idx].status != 0)
+        panic_concat(2, disk[q->id].name, ": virtio disk status");
+
+      for(int i = 0; i < q->info[idx].n; i++){
+        struct disk_req *r = q->info[idx].r[i];
+        r->done = 1;
+        wakeup(r);
+      }
+      q->info[idx].n = 0;
+      free_chain(q, idx);
+      q->inflight--;
+
+      q->used_idx += 1;
+    }
+
+    dispatch(q);
+
+    if(disk[q->id].event_idx){
+      int n = q->inflight > 0 ? q->inflight - 1 : 0;
+      if(q->queue)
+        n = 0;
+      q->avail->used_event = q->used_idx + n;
+    }
+    __sync_synchronize();
+  } while(q->used_idx != q->used->idx);
+}
+
+// should a waiter on disk id poll rather than sleep?
+static int
+polling(struct vq *q)
+{
+  return disk[q->id].poll == VIRTIO_POLL_ON ||
+         (disk[q->id].poll == VIRTIO_POLL_ADAPTIVE &&
+          q->inflight >= VIRTIO_POLL_DEPTH);
+}
+
+// spin on the used ring until r is done or VIRTIO_POLL_SPIN
+// has passed, reaping whatever completes meanwhile. the caller
+// holds q->lock; it is let go between looks so that the
+// interrupt handler, and other submitters, are not shut out.
+static void
+poll(struct vq *q, struct disk_req *r)
+{
+  uint64 end = mtime() + VIRTIO_POLL_SPIN;
+
+  while(!r->done && mtime() < end){
+    __sync_synchronize();
+    if(q->used_idx != q->used->idx){
+      reap(q);
+    } else {
+      release(&q->lock);
+      acquire(&q->lock);
+    }
+  }
+}
+
+// does q hold r, queued or in flight? the caller holds q->lock.
+static int
+holds(struct vq *q, struct disk_req *r)
+{
+  for(struct qent *e = q->queue; e; e = e->next){
+    if(e->r == r)
+      return 1;
+  }
+  for(int i = 0; i < NUM; i++){
+    for(int j = 0; j < q->info[i].n; j++){
+      if(q->info[i].r[j] == r)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+// the queue r went to, with its lock held, or 0 if r is done.
+// a request stays on the queue of the hart that submitted it
+// until it is done, but the waiter may have moved since.
+static struct vq *
+lockvq(struct disk_req *r)
+{
+  struct disk *dk = &disk[r->diskn];
+
+  for(int i = 0; i < dk->nvq; i++){
+    struct vq *q = &dk->q[i];
+    acquire(&q->lock);
+    if(r->done){
+      release(&q->lock);
+      return 0;
+    }
+    if(dk->nvq == 1 || holds(q, r))
+      return q;
+    release(&q->lock);
+  }
+  return 0;
+}
+
+// wait for n requests started by virtio_disk_submit() to finish.
+void
+virtio_disk_wait(struct disk_req *reqs, int n)
+{
+  for(int i = 0; i < n; i++){
+    struct vq *q = lockvq(&reqs[i]);
+
+    if(q == 0)
+      continue;
+    if(!reqs[i].done && polling(q))
+      poll(q, &reqs[i]);
+    while(!reqs[i].done)
+      sleep(&reqs[i], &q->lock);
+    release(&q->lock);
+  }
+}
+
+// set how waiters on disk id learn that their requests are
+// done, and return the old setting, or -1 if there is no
+// such disk or mode.
+int
+virtio_disk_poll(int id, int mode)
+{
+  int old;
+
+  if(id < VIRTIO0_ID || id > VIRTIO_RAID_DISK_END || disk[id].name == 0)
+    return -1;
+  if(mode != VIRTIO_POLL_OFF && mode != VIRTIO_POLL_ON &&
+     mode != VIRTIO_POLL_ADAPTIVE)
+    return -1;
+
+  for(int i = 0; i < disk[id].nvq; i++)
+    acquire(&disk[id].q[i].lock);
+  old = disk[id].poll;
+  disk[id].poll = mode;
+  for(int i = 0; i < disk[id].nvq; i++)
+    release(&disk[id].q[i].lock);
+  return old;
+}
+
+// set the scheduler of disk id's request queue, and return the
+// old one, or -1 if there is no such disk or scheduler.
+int
+virtio_disk_sched(int id, int sched)
+{
+  int old;
+
+  if(id < VIRTIO0_ID || id > VIRTIO_RAID_DISK_END || disk[id].name == 0)
+    return -1;
+  if(sched < 0 || sched >= NELEM(scheds))
+    return -1;
+
+  for(int i = 0; i < disk[id].nvq; i++)
+    acquire(&disk[id].q[i].lock);
+  old = disk[id].sched - scheds;
+  disk[id].sched = &scheds[sched];
+  for(int i = 0; i < disk[id].nvq; i++)
+    release(&disk[id].q[i].lock);
+  return old;
+}
+
+void
+virtio_disk_rw(int id, struct buf *b, int write)
+{
+  struct disk_req r;
+
+  r.diskn = id;
+  r.blockno = b->blockno;
+  r.data = b->data;
+  r.write = write;
+
+  b->disk = 1;
+  virtio_disk_submit(&r, 1);
+
+  // Wait for reap() to say request has finished.
+  virtio_disk_wait(&r, 1);
+  b->disk = 0;   // disk is done with buf
+}
+
+// can the device DMA straight to and from p?
+// only the kernel's direct mapping has va == pa;
+// kernel stacks, for one, are mapped elsewhere.
+static int
+dma_ok(uchar *p)
+{
+  return (uint64)p >= KERNBASE && (uint64)p + BSIZE <= PHYSTOP;
+}
+
+// is p one of the bounce blocks?
+static int
+is_bounce(uchar *p)
+{
+  return p >= bounce.data[0] && p < bounce.data[NBOUNCE];
+}
+
+// give the first n of reqs whose data the device can't reach
+// bounce blocks in its place, all at once so that callers
+// holding some of the pool can never wait on each other.
+static void
+bounce_get(struct disk_req *reqs, int n)
+{
+  int nb = 0;
+
+  for(int i = 0; i < n; i++){
+    if(!dma_ok(reqs[i].data))
+      nb++;
+  }
+  if(nb == 0)
+    return;
+
+  acquire(&bounce.lock);
+  while(bounce.nfree < nb)
+    sleep(&bounce, &bounce.lock);
+  for(int i = 0, j = 0; i < n; i++){
+    if(dma_ok(reqs[i].data))
+      continue;
+    while(!bounce.free[j])
+      j++;
+    bounce.free[j] = 0;
+    bounce.orig[j] = reqs[i].data;
+    reqs[i].data = bounce.data[j];
+  }
+  bounce.nfree -= nb;
+  release(&bounce.lock);
+
+  for(int i = 0; i < n; i++){
+    if(reqs[i].write && is_bounce(reqs[i].data))
+      memmove(reqs[i].data, bounce.orig[(reqs[i].data - bounce.data[0]) / BSIZE], BSIZE);
+  }
+}
+
+// give back the bounce blocks of the first n of reqs, copying
+// what was read into the data they stood in for.
+static void
+bounce_put(struct disk_req *reqs, int n)
+{
+  int nb = 0;
+
+  for(int i = 0; i < n; i++){
+    if(!is_bounce(reqs[i].data))
+      continue;
+    if(!reqs[i].write)
+      memmove(bounce.orig[(reqs[i].data - bounce.data[0]) / BSIZE], reqs[i].data, BSIZE);
+    nb++;
+  }
+  if(nb == 0)
+    return;
+
+  acquire(&bounce.lock);
+  for(int i = 0; i < n; i++){
+    if(!is_bounce(reqs[i].data))
+      continue;
+    int j = (reqs[i].data - bounce.data[0]) / BSIZE;
+    reqs[i].data = bounce.orig[j];
+    bounce.free[j] = 1;
+  }
+  bounce.nfree += nb;
+  wakeup(&bounce);
+  release(&bounce.lock);
+}
+
+// read or write a set of blocks on the RAID member disks.
+// every request is put in flight at once, any number per disk.
+// data the device can reach is transferred in place; the rest
+// goes through bounce blocks, NBOUNCE requests per round.
+void
+rw_blocks(struct disk_req *reqs, int n)
+{
+  while(n > 0){
+    int nio = n < NBOUNCE ? n : NBOUNCE;
+
+    bounce_get(reqs, nio);
+    virtio_disk_submit(reqs, nio);
+    virtio_disk_wait(reqs, nio);
+    bounce_put(reqs, nio);
+
+    reqs += nio;
+    n -= nio;
+  }
+}
+
+void write_block(int diskn, int blockno, uchar* data) {
+    struct disk_req r;
+
+    r.diskn = diskn;
+    r.blockno = blockno;
+    r.data = data;
+    r.write = 1;
+    rw_blocks(&r, 1);
 }
 
 void read_block(int diskn, int blockno, uchar* data) {
-    struct buf *b = transfer_buffer[diskn];
-    b->blockno = blockno;
+    struct disk_req r;
 
-    virtio_disk_rw(diskn, b, 0);
-    memmove(data, b->data, BSIZE);
+    r.diskn = diskn;
+    r.blockno = blockno;
+    r.data = data;
+    r.write = 0;
+    rw_blocks(&r, 1);
 }
 
+// the device has one interrupt for all its queues, so look at
+// every one of them.
 void
 virtio_disk_intr(int id)
 {
-  acquire(&disk[id].vdisk_lock);
-
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
@@ -341,23 +1021,9 @@ virtio_disk_intr(int id)
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk[id].used_idx != disk[id].used->idx){
-    __sync_synchronize();
-    int idx = disk[id].used->ring[disk[id].used_idx % NUM].id;
-
-    if(disk[id].info[idx].status != 0)
-      panic_concat(2, disk[id].name, ": virtio_disk_intr status");
-
-    struct buf *b = disk[id].info[idx].b;
-    b->disk = 0;   // disk is done with buf
-
-    wakeup(b);
-
-    disk[id].used_idx += 1;
+  for(int i = 0; i < disk[id].nvq; i++){
+    acquire(&disk[id].q[i].lock);
+    reap(&disk[id].q[i]);
+    release(&disk[id].q[i].lock);
   }
-
-  release(&disk[id].vdisk_lock);
 }
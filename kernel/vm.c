@@ -37,6 +37,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT mtime, read-only, for mtime().
+  kvmmap(kpgtbl, PGROUNDDOWN(CLINT_MTIME), PGROUNDDOWN(CLINT_MTIME), PGSIZE, PTE_R);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -9,7 +9,7 @@ main(int argc, char *argv[])
 {
 //    consputc('a');
 
-  init_raid(RAID0);
+  init_raid(RAID0, 1, 0, 0);
 
   uint disk_num, block_num, block_size;
   info_raid(&block_num, &block_size, &disk_num);
@@ -17,12 +17,21 @@ main(int argc, char *argv[])
   uint blocks = (512 > block_num ? block_num : 512);
   printf("%d, %d, %d ", block_num, block_size, disk_num);
   uchar* blk = malloc(block_size);
-  for (uint i = 0; i < blocks; i++) {
-    for (uint j = 0; j < block_size; j++) {
-      blk[j] = j + i;
+  // bulk load with writev_raid, 16 blocks per call.
+  struct raid_iovec iov[16];
+  uchar* bulk = malloc(16 * block_size);
+  for (uint i = 0; i < blocks; i += 16) {
+    uint n = blocks - i < 16 ? blocks - i : 16;
+    for (uint k = 0; k < n; k++) {
+      iov[k].blkn = i + k;
+      iov[k].addr = bulk + k * block_size;
+      for (uint j = 0; j < block_size; j++) {
+        bulk[k * block_size + j] = j + i + k;
+      }
     }
-    write_raid(i, blk);
+    writev_raid(iov, n);
   }
+  free(bulk);
     printf("PROSAO");
   check_data(blocks, blk, block_size);
     printf("PROSAO");
@@ -0,0 +1,118 @@
+// Build an empty file system on the RAID array, laid out like the
+// one mkfs/mkfs builds for fs.img: boot block, superblock, log,
+// inodes, free bitmap, then data, with just a root directory.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define NINODES 200
+#define BATCH 16 // blocks per writev_raid() call
+
+static uchar zero[BSIZE];
+static uchar blk[BSIZE];
+
+// Write zeros to blocks from .. to - 1.
+static int
+wzero(uint from, uint to)
+{
+  struct raid_iovec iov[BATCH];
+
+  while(from < to){
+    int n = to - from < BATCH ? to - from : BATCH;
+    for(int i = 0; i < n; i++){
+      iov[i].blkn = from + i;
+      iov[i].addr = zero;
+    }
+    if(writev_raid(iov, n) < 0)
+      return -1;
+    from += n;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct superblock sb;
+  struct dinode *din;
+  struct dirent *de;
+  uint size, bsize, ndisks;
+  int ninodes = NINODES;
+
+  if(argc > 2){
+    fprintf(2, "Usage: mkfs [ninodes]\n");
+    exit(1);
+  }
+  if(argc == 2)
+    ninodes = atoi(argv[1]);
+  if(info_raid(&size, &bsize, &ndisks) < 0 || bsize != BSIZE){
+    fprintf(2, "mkfs: no RAID array\n");
+    exit(1);
+  }
+
+  int nbitmap = size/BPB + 1;
+  int ninodeblocks = ninodes/IPB + 1;
+  int nlog = LOGSIZE;
+  int nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  if(ninodes < 2 || nmeta + 1 > size || nmeta + 1 > BPB){
+    fprintf(2, "mkfs: %d blocks is too small for %d inodes\n", size, ninodes);
+    exit(1);
+  }
+
+  memset(&sb, 0, sizeof(sb));
+  sb.magic = FSMAGIC;
+  sb.size = size;
+  sb.nblocks = size - nmeta;
+  sb.ninodes = ninodes;
+  sb.nlog = nlog;
+  sb.logstart = 2;
+  sb.inodestart = 2 + nlog;
+  sb.bmapstart = 2 + nlog + ninodeblocks;
+
+  // an empty log header, no inodes and a clear bitmap.
+  if(wzero(0, nmeta) < 0)
+    goto bad;
+
+  // the root directory, in the first data block.
+  uint rootblk = nmeta;
+  memset(blk, 0, BSIZE);
+  de = (struct dirent*)blk;
+  de[0].inum = ROOTINO;
+  strcpy(de[0].name, ".");
+  de[1].inum = ROOTINO;
+  strcpy(de[1].name, "..");
+  if(write_raid(rootblk, blk) < 0)
+    goto bad;
+
+  memset(blk, 0, BSIZE);
+  din = (struct dinode*)blk + ROOTINO % IPB;
+  din->type = T_DIR;
+  din->nlink = 1;
+  din->size = BSIZE;
+  din->addrs[0] = rootblk;
+  if(write_raid(IBLOCK(ROOTINO, sb), blk) < 0)
+    goto bad;
+
+  // blocks 0 .. rootblk are in use.
+  memset(blk, 0, BSIZE);
+  for(int b = 0; b <= rootblk; b++)
+    blk[b/8] |= 1 << (b%8);
+  if(write_raid(sb.bmapstart, blk) < 0)
+    goto bad;
+
+  // the superblock last, so a failed mkfs leaves nothing to mount.
+  memset(blk, 0, BSIZE);
+  memmove(blk, &sb, sizeof(sb));
+  if(write_raid(1, blk) < 0)
+    goto bad;
+
+  printf("mkfs: %d blocks, %d inodes, %d data blocks\n", size, ninodes, sb.nblocks);
+  exit(0);
+
+bad:
+  fprintf(2, "mkfs: write failed; is the array mounted?\n");
+  exit(1);
+}
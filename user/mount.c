@@ -0,0 +1,17 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  if(argc != 2){
+    fprintf(2, "Usage: mount dir\n");
+    exit(1);
+  }
+  if(mount_raid(argv[1]) < 0){
+    fprintf(2, "mount: cannot mount the RAID array on %s\n", argv[1]);
+    exit(1);
+  }
+  exit(0);
+}
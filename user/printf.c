@@ -13,11 +13,11 @@ putc(int fd, char c)
 }
 
 static void
-printint(int fd, int xx, int base, int sgn)
+printint(int fd, long xx, int base, int sgn)
 {
-  char buf[16];
+  char buf[20];
   int i, neg;
-  uint x;
+  uint64 x;
 
   neg = 0;
   if(sgn && xx < 0){
@@ -69,7 +69,7 @@ vprintf(int fd, const char *fmt, va_list ap)
       } else if(c == 'l') {
         printint(fd, va_arg(ap, uint64), 10, 0);
       } else if(c == 'x') {
-        printint(fd, va_arg(ap, int), 16, 0);
+        printint(fd, va_arg(ap, uint), 16, 0);
       } else if(c == 'p') {
         printptr(fd, va_arg(ap, uint64));
       } else if(c == 's'){
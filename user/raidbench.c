@@ -0,0 +1,161 @@
+// Measure RAID read (and, with -w, write) latency with the member
+// disks' completions taken by interrupt, by polling, and by adaptive
+// polling, and print the p50 and p99 of each.
+// raidbench [-w] [-n requests] [-p processes] [-s noop|deadline|clook]
+// Each process reads -n blocks, one at a time, spread over the array;
+// more processes mean deeper disk queues. With -w every block read is
+// written back unchanged, so don't run it on a mounted array.
+// The times come from stat_raid(), so they have its log2 buckets'
+// resolution, and the statistics are reset as it goes. -s runs it all
+// with the disks' queues under the given scheduler.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+static char *modename[] = {
+[VIRTIO_POLL_OFF]      "interrupt",
+[VIRTIO_POLL_ON]       "poll",
+[VIRTIO_POLL_ADAPTIVE] "adaptive",
+};
+
+static char *schedname[] = {
+[VIRTIO_SCHED_NOOP]     "noop",
+[VIRTIO_SCHED_DEADLINE] "deadline",
+[VIRTIO_SCHED_CLOOK]    "clook",
+};
+
+static struct raid_stat st;
+static uchar buf[BSIZE];
+
+// set every disk there is to mode.
+static void
+setpoll(int mode)
+{
+  for(int d = 1; d <= NRAIDDISK; d++)
+    poll_raid(d, mode);
+}
+
+static int
+schedbyname(char *name)
+{
+  for(int s = VIRTIO_SCHED_NOOP; s <= VIRTIO_SCHED_CLOOK; s++)
+    if(strcmp(name, schedname[s]) == 0)
+      return s;
+  return -1;
+}
+
+static void
+setsched(int sched)
+{
+  for(int d = 1; d <= NRAIDDISK; d++)
+    sched_raid(d, sched);
+}
+
+// the upper bound, in microseconds, of the bucket that holds
+// the p'th percentile of op.
+static uint64
+percentile(int op, int p)
+{
+  uint64 want = (st.ops[op] * p + 99) / 100;
+  uint64 seen = 0;
+  int b;
+
+  for(b = 0; b < RAID_STAT_BUCKETS - 1; b++){
+    seen += st.hist[op][b];
+    if(seen >= want)
+      break;
+  }
+  return (1UL << (b + 1)) * 1000000 / st.hz;
+}
+
+static void
+report(char *what, int op)
+{
+  if(st.ops[op] == 0)
+    return;
+  printf("  %s: %l, mean %l us, p50 < %l us, p99 < %l us\n", what,
+         st.ops[op], st.ticks[op] / st.ops[op] * 1000000 / st.hz,
+         percentile(op, 50), percentile(op, 99));
+}
+
+static void
+run(uint blks, int n, int seed, int write)
+{
+  uint x = seed * 2654435761U + 1;
+
+  for(int i = 0; i < n; i++){
+    x = x * 1103515245 + 12345;
+    uint blkn = (x >> 8) % blks;
+    if(read_raid(blkn, buf) < 0){
+      fprintf(2, "raidbench: read of block %d failed\n", blkn);
+      exit(1);
+    }
+    if(write && write_raid(blkn, buf) < 0){
+      fprintf(2, "raidbench: write of block %d failed\n", blkn);
+      exit(1);
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n = 1000, procs = 1, write = 0, sched = -1;
+  uint blks, blksize, diskn;
+
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-w") == 0)
+      write = 1;
+    else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      n = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      procs = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc &&
+            (sched = schedbyname(argv[++i])) >= 0)
+      ;
+    else {
+      fprintf(2, "Usage: raidbench [-w] [-n requests] [-p processes] [-s noop|deadline|clook]\n");
+      exit(1);
+    }
+  }
+  if(info_raid(&blks, &blksize, &diskn) < 0 || blks == 0){
+    fprintf(2, "raidbench: no RAID array\n");
+    exit(1);
+  }
+
+  int old = poll_raid(1, VIRTIO_POLL_OFF);
+  int oldsched = -1;
+  if(sched >= 0){
+    oldsched = sched_raid(1, sched);
+    setsched(sched);
+  }
+  for(int mode = VIRTIO_POLL_OFF; mode <= VIRTIO_POLL_ADAPTIVE; mode++){
+    setpoll(mode);
+    stat_raid(&st, 1);
+    for(int p = 0; p < procs; p++){
+      int pid = fork();
+      if(pid < 0){
+        fprintf(2, "raidbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        run(blks, n, p, write);
+        exit(0);
+      }
+    }
+    for(int p = 0; p < procs; p++)
+      wait(0);
+    stat_raid(&st, 1);
+
+    printf("%s\n", modename[mode]);
+    report("read", RAID_STAT_READ);
+    report("write", RAID_STAT_WRITE);
+  }
+  if(old >= 0)
+    setpoll(old);
+  if(oldsched >= 0)
+    setsched(oldsched);
+  exit(0);
+}
@@ -0,0 +1,66 @@
+// Print the RAID array's I/O statistics: what each disk did, how
+// reads and writes were served, and how long they took.
+// raidstat -r resets them after printing.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+static char *opname[RAID_STAT_OPS] = {
+[RAID_STAT_READ]        "read",
+[RAID_STAT_WRITE]       "write",
+[RAID_STAT_RECONSTRUCT] "reconstruct",
+[RAID_STAT_REBUILD]     "rebuild",
+};
+
+static struct raid_stat st;
+
+// ticks of mtime in microseconds.
+static uint64
+usecs(uint64 ticks)
+{
+  return ticks * 1000000 / st.hz;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int reset = 0;
+
+  if(argc == 2 && strcmp(argv[1], "-r") == 0)
+    reset = 1;
+  else if(argc != 1){
+    fprintf(2, "Usage: raidstat [-r]\n");
+    exit(1);
+  }
+  if(stat_raid(&st, reset) < 0){
+    fprintf(2, "raidstat: no RAID array\n");
+    exit(1);
+  }
+
+  printf("disk reads writes KB-read KB-written\n");
+  for(int d = 1; d <= NRAIDDISK; d++){
+    struct raid_disk_stat *ds = &st.disk[d];
+    if(ds->reads == 0 && ds->writes == 0)
+      continue;
+    printf("%d %l %l %l %l\n", d, ds->reads, ds->writes,
+           ds->read_bytes / 1024, ds->write_bytes / 1024);
+  }
+  printf("cache hits %l, degraded reads %l, read-modify-writes %l, reconstruct-writes %l\n",
+         st.cache_hits, st.degraded_reads, st.rmw, st.rcw);
+
+  for(int op = 0; op < RAID_STAT_OPS; op++){
+    if(st.ops[op] == 0)
+      continue;
+    printf("%s: %l, mean %l us\n", opname[op], st.ops[op], usecs(st.ticks[op] / st.ops[op]));
+    for(int b = 0; b < RAID_STAT_BUCKETS; b++){
+      if(st.hist[op][b] == 0)
+        continue;
+      if(b == RAID_STAT_BUCKETS - 1)
+        printf("  >= %l us: %l\n", usecs(1UL << b), st.hist[op][b]);
+      else
+        printf("  < %l us: %l\n", usecs(1UL << (b + 1)), st.hist[op][b]);
+    }
+  }
+  exit(0);
+}
@@ -1,3 +1,5 @@
+#include "kernel/param.h"
+
 struct stat;
 
 // system calls
@@ -40,12 +42,54 @@ int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
 
-enum RAID_TYPE {RAID0, RAID1, RAID0_1, RAID4, RAID5};
-int init_raid(enum RAID_TYPE raid);
+enum RAID_TYPE {RAID0, RAID1, RAID0_1, RAID4, RAID5, RAID6};
+struct raid_iovec {
+  uint blkn;
+  void *addr;
+};
+#define VIRTIO_POLL_OFF 0
+#define VIRTIO_POLL_ON 1
+#define VIRTIO_POLL_ADAPTIVE 2
+#define VIRTIO_SCHED_NOOP 0
+#define VIRTIO_SCHED_DEADLINE 1
+#define VIRTIO_SCHED_CLOOK 2
+#define RAID_STAT_READ 0
+#define RAID_STAT_WRITE 1
+#define RAID_STAT_RECONSTRUCT 2
+#define RAID_STAT_REBUILD 3
+#define RAID_STAT_OPS 4
+#define RAID_STAT_BUCKETS 20
+struct raid_disk_stat {
+  uint64 reads, writes;
+  uint64 read_bytes, write_bytes;
+};
+struct raid_stat {
+  uint64 hz;
+  struct raid_disk_stat disk[NRAIDDISK + 1];
+  uint64 cache_hits;
+  uint64 degraded_reads;
+  uint64 rmw;
+  uint64 rcw;
+  uint64 ops[RAID_STAT_OPS];
+  uint64 ticks[RAID_STAT_OPS];
+  uint64 hist[RAID_STAT_OPS][RAID_STAT_BUCKETS];
+};
+int init_raid(enum RAID_TYPE raid, int chunk, int ndisks, int nspares);
 int read_raid(int blkn, uchar* data);
 int write_raid(int blkn, uchar* data);
 int disk_fail_raid(int diskn);
 int disk_repaired_raid(int diskn);
 int info_raid(uint *blkn, uint *blks, uint *diskn);
 int destroy_raid();
+int readv_raid(struct raid_iovec *iov, int iovcnt);
+int writev_raid(struct raid_iovec *iov, int iovcnt);
+int rebuild_info_raid(uint *diskn, uint *done, uint *total);
+int rebuild_rate_raid(int rows);
+int scrub_raid(int repair);
+int scrub_info_raid(uint *checked, uint *mismatches, uint *repaired);
+int reshape_raid(enum RAID_TYPE raid, int ndisks);
+int mount_raid(const char *path);
+int stat_raid(struct raid_stat *st, int reset);
+int poll_raid(int diskn, int mode);
+int sched_raid(int diskn, int sched);
 
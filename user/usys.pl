@@ -44,3 +44,14 @@ entry("disk_fail_raid");
 entry("disk_repaired_raid");
 entry("info_raid");
 entry("destroy_raid");
+entry("readv_raid");
+entry("writev_raid");
+entry("rebuild_info_raid");
+entry("rebuild_rate_raid");
+entry("scrub_raid");
+entry("scrub_info_raid");
+entry("reshape_raid");
+entry("mount_raid");
+entry("stat_raid");
+entry("poll_raid");
+entry("sched_raid");